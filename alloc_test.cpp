@@ -0,0 +1,217 @@
+/* allocation regression test: the decode, format, execute and trace loops must not touch the heap.
+
+links a counting operator new, then runs sim8086 and simulate8089 in process over every file of
+the corpus, once as it is and once repeated REPEAT times. setup (arena blocks, the trace ring,
+pipeline threads) may allocate a fixed number of times, but a longer input must not add a single
+allocation. exits 1 when one does, or when a run fails.
+
+usage:
+    g++ -O2 -pthread -o alloc_test alloc_test.cpp && ./alloc_test [corpus_dir]   (default decoder_test)
+*/
+// every header the two tools include, so their own #includes below are no-ops at namespace scope
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "mapped_file.h"
+#include "perf_counters.h"
+#include "trace8089.h"
+
+static std::atomic<size_t> allocations{0};
+
+// gcc pairs the inlined malloc below with the free in operator delete and warns, wrongly
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, std::align_val_t align) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    size_t a = size_t(align);
+    if (void* p = std::aligned_alloc(a, (size + a - 1) / a * a)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size, std::align_val_t align) { return operator new(size, align); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { operator delete(p); }
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+void operator delete[](void* p, size_t) noexcept { operator delete(p); }
+void operator delete(void* p, std::align_val_t) noexcept { operator delete(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { operator delete(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { operator delete(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { operator delete(p); }
+
+#define main sim8086_main
+namespace sim8086 {
+#include "sim8086.cpp"
+}
+#undef main
+
+#define main simulate8089_main
+namespace simulate8089 {
+#include "simulate8089.cpp"
+}
+#undef main
+
+static constexpr int REPEAT = 64;
+
+typedef int (*Entry)(int, char**);
+
+/* runs one tool with stdout sent to /dev/null and returns the allocations it made, or -1 when
+ * it failed. the argument vector is built before counting starts
+ */
+static long countAllocations(Entry entry, std::vector<std::string> args) {
+    std::vector<char*> argv;
+    for (std::string& arg : args) argv.push_back(arg.data());
+    argv.push_back(nullptr);
+
+    std::cout.flush();
+    int saved = dup(STDOUT_FILENO);
+    int null = ::open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    ::close(null);
+
+    size_t before = allocations.load();
+    int status = entry(int(args.size()), argv.data());
+    size_t made = allocations.load() - before;
+
+    std::cout.flush();
+    dup2(saved, STDOUT_FILENO);
+    ::close(saved);
+    return status == 0 ? long(made) : -1;
+}
+
+static bool writeFile(const std::string& path, const std::string& data) {
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+    bool ok = f && std::fwrite(data.data(), 1, data.size(), f) == data.size();
+    return f && std::fclose(f) == 0 && ok;
+}
+
+static bool readFile(const std::string& path, std::string& data) {
+    MappedFile in;
+    if (!in.open(path.c_str())) return false;
+    data.assign(in.data, in.size);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    std::string corpus = argc > 1 ? argv[1] : "decoder_test";
+    std::vector<std::string> names;
+    if (DIR* dir = opendir(corpus.c_str())) {
+        while (dirent* entry = readdir(dir)) {
+            if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+        }
+        closedir(dir);
+    }
+    if (names.empty()) {
+        std::cerr << "Error: no corpus files in " << corpus << std::endl;
+        return 1;
+    }
+    std::sort(names.begin(), names.end());
+
+    char scratch[] = "/tmp/alloc_test.XXXXXX";
+    if (!mkdtemp(scratch)) {
+        std::cerr << "Error: cannot create a scratch directory" << std::endl;
+        return 1;
+    }
+    const std::string dir = scratch;
+    const std::string trace = dir + "/run.trc";
+
+    struct Case {
+        const char* tool;
+        Entry entry;
+        std::vector<std::string> options;
+        bool source;  // simulate8089 takes assembly source, sim8086 any byte image
+    };
+    const Case cases[] = {
+        {"sim8086", sim8086::sim8086_main, {}, false},
+        {"sim8086", sim8086::sim8086_main, {"--pipeline"}, false},
+        {"simulate8089", simulate8089::simulate8089_main, {}, true},
+        {"simulate8089", simulate8089::simulate8089_main, {"--timing", "8088"}, true},
+        {"simulate8089", simulate8089::simulate8089_main, {"--trace", trace}, true},
+    };
+
+    int failures = 0;
+    for (const std::string& name : names) {
+        std::string data;
+        if (!readFile(corpus + "/" + name, data)) {
+            std::cerr << "Error opening file: " << corpus << "/" << name << std::endl;
+            return 1;
+        }
+        bool source = name.size() > 4 && name.compare(name.size() - 4, 4, ".asm") == 0;
+        if (source && !data.empty() && data.back() != '\n') data += '\n';
+
+        std::string repeated;
+        for (int i = 0; i < REPEAT; ++i) repeated += data;
+        const std::string small = dir + "/small", large = dir + "/large";
+        if (!writeFile(small, data) || !writeFile(large, repeated)) {
+            std::cerr << "Error writing to " << dir << std::endl;
+            return 1;
+        }
+
+        for (const Case& c : cases) {
+            if (c.source && !source) continue;
+            std::vector<std::string> args = {c.tool};
+            args.insert(args.end(), c.options.begin(), c.options.end());
+            std::string label = c.tool;
+            for (const std::string& option : c.options) label += " " + option;
+
+            std::vector<std::string> small_args = args, large_args = args;
+            small_args.push_back(small);
+            large_args.push_back(large);
+            long once = countAllocations(c.entry, small_args);
+            long many = countAllocations(c.entry, large_args);
+
+            bool ok = once >= 0 && many == once;
+            if (!ok) ++failures;
+            std::cout << (ok ? "ok   " : "FAIL ") << label << " " << name << ": " << once << " allocations, "
+                      << many << " with the input repeated " << REPEAT << " times" << std::endl;
+        }
+    }
+
+    unlink(trace.c_str());
+    unlink((dir + "/small").c_str());
+    unlink((dir + "/large").c_str());
+    rmdir(dir.c_str());
+    if (failures) {
+        std::cerr << failures << " run(s) allocated in a steady-state loop or failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
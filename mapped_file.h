@@ -0,0 +1,58 @@
+/* read-only memory mapping of a whole input file, shared by sim8086 and simulate8089.
+ * the kernel pages the file in on demand, so loading an image costs no copy and no
+ * heap allocation
+ */
+#pragma once
+#include <cstddef>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const char* path) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+        if (size == 0) {
+            // mmap refuses zero length mappings
+            data = "";
+            ::close(fd);
+            return true;
+        }
+
+        void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            size = 0;
+            return false;
+        }
+        madvise(p, size, MADV_SEQUENTIAL);
+        data = static_cast<const char*>(p);
+        return true;
+    }
+
+    // reads one byte of every page so a measured run does not fault the file in later
+    void prefault() const {
+        volatile char sink = 0;
+        long page = sysconf(_SC_PAGESIZE);
+        for (size_t i = 0; i < size; i += page) sink = sink + data[i];
+    }
+
+    ~MappedFile() {
+        if (size) munmap(const_cast<char*>(data), size);
+    }
+};
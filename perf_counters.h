@@ -0,0 +1,199 @@
+/* hardware performance counters for the --perf mode of sim8086 and simulate8089.
+ * work is bracketed with begin(phase)/end(), and report() prints the cycles, instructions,
+ * branch misses and cache misses of each phase with its IPC and rates per 8086 instruction.
+ * a phase can be entered many times (once per batch, say) and its counts add up.
+ *
+ * counters are opened one by one through perf_event_open for the calling thread. when the
+ * kernel refuses kernel mode counting (perf_event_paranoid >= 2) they fall back to user space
+ * only. any counter that cannot be opened (no PMU in a VM, seccomp, paranoid 3) is shown as "-".
+ * wall time is always reported
+ */
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+class PerfCounters {
+public:
+    enum Event { CYCLES, INSTRUCTIONS, BRANCH_MISSES, CACHE_MISSES, EVENT_COUNT };
+
+    PerfCounters() {
+        static constexpr uint64_t configs[EVENT_COUNT] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES,
+        };
+        for (int e = 0; e < EVENT_COUNT; ++e) {
+            fds[e] = openCounter(configs[e], false);
+            if (fds[e] < 0 && (errno == EACCES || errno == EPERM)) {
+                fds[e] = openCounter(configs[e], true);
+                if (fds[e] >= 0) user_only = true;
+            }
+            if (fds[e] < 0 && !open_error) open_error = errno;
+            if (fds[e] >= 0) ++opened;
+        }
+    }
+
+    ~PerfCounters() {
+        for (int fd : fds) {
+            if (fd >= 0) close(fd);
+        }
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    // phases are reported in the order they are first begun, and must not nest
+    void begin(const char* name) {
+        current = nullptr;
+        for (int i = 0; i < phase_count; ++i) {
+            if (std::strcmp(phases[i].name, name) == 0) current = &phases[i];
+        }
+        if (!current) {
+            if (phase_count == MAX_PHASES) return;
+            current = &phases[phase_count++];
+            current->name = name;
+            for (bool& valid : current->valid) valid = true;
+        }
+        sample(start);
+        start_ns = now();
+    }
+
+    // items is the number of 8086 instructions handled since begin(), 0 when rates make no sense
+    void end(uint64_t items) {
+        if (!current) return;
+        uint64_t end_ns = now();
+        Reading stop[EVENT_COUNT];
+        sample(stop);
+        current->ns += end_ns - start_ns;
+        current->items += items;
+        for (int e = 0; e < EVENT_COUNT; ++e) {
+            uint64_t running = stop[e].running - start[e].running;
+            if (fds[e] < 0 || running == 0) {
+                current->valid[e] = false;
+                continue;
+            }
+            // scale up when the kernel had to multiplex the counter with other events
+            uint64_t enabled = stop[e].enabled - start[e].enabled;
+            double value = double(stop[e].value - start[e].value);
+            current->counts[e] += value * double(enabled) / double(running);
+        }
+        current = nullptr;
+    }
+
+    void report(std::FILE* out) const {
+        if (open_error) {
+            bool denied = open_error == EACCES || open_error == EPERM;
+            std::fprintf(out, "perf: %s counters are unavailable (%s)%s\n", opened ? "some" : "hardware",
+                         std::strerror(open_error), denied ? ", see /proc/sys/kernel/perf_event_paranoid" : "");
+            if (!opened) std::fprintf(out, "perf: reporting wall time only\n");
+        }
+        if (user_only) std::fprintf(out, "perf: counting user space only\n");
+
+        std::fprintf(out, "%-8s %10s %14s %14s %6s %14s %14s\n",
+                     "phase", "ms", "cycles", "instructions", "IPC", "branch-misses", "cache-misses");
+        Phase total{};
+        total.name = "total";
+        for (int e = 0; e < EVENT_COUNT; ++e) total.valid[e] = phase_count > 0;
+        for (int i = 0; i < phase_count; ++i) {
+            const Phase& phase = phases[i];
+            printPhase(out, phase);
+            total.ns += phase.ns;
+            for (int e = 0; e < EVENT_COUNT; ++e) {
+                total.valid[e] = total.valid[e] && phase.valid[e];
+                total.counts[e] += phase.counts[e];
+            }
+        }
+        printPhase(out, total);
+
+        std::fprintf(out, "\n%-20s %14s %14s %14s %14s %10s\n",
+                     "per 8086 instruction", "cycles", "instructions", "branch-misses", "cache-misses", "ns");
+        for (int i = 0; i < phase_count; ++i) {
+            const Phase& phase = phases[i];
+            if (!phase.items) continue;
+            std::fprintf(out, "%-20s", phase.name);
+            for (int e = 0; e < EVENT_COUNT; ++e) {
+                printValue(out, phase.valid[e], phase.counts[e] / phase.items, e < BRANCH_MISSES ? "%.1f" : "%.4f");
+            }
+            std::fprintf(out, " %10.2f\n", double(phase.ns) / phase.items);
+        }
+    }
+
+private:
+    static constexpr int MAX_PHASES = 8;
+
+    struct Reading {
+        uint64_t value;
+        uint64_t enabled;
+        uint64_t running;
+    };
+
+    struct Phase {
+        const char* name;
+        uint64_t ns;
+        uint64_t items;
+        double counts[EVENT_COUNT];
+        bool valid[EVENT_COUNT];
+    };
+
+    static int openCounter(uint64_t config, bool user_only) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.exclude_kernel = user_only;
+        attr.exclude_hv = 1;
+        return int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    static uint64_t now() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return uint64_t(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+    }
+
+    void sample(Reading* readings) const {
+        for (int e = 0; e < EVENT_COUNT; ++e) {
+            if (fds[e] < 0 || read(fds[e], &readings[e], sizeof(Reading)) != sizeof(Reading)) {
+                readings[e] = {};
+            }
+        }
+    }
+
+    static void printValue(std::FILE* out, bool valid, double value, const char* format) {
+        char text[32];
+        if (valid) std::snprintf(text, sizeof(text), format, value);
+        else std::snprintf(text, sizeof(text), "-");
+        std::fprintf(out, " %14s", text);
+    }
+
+    static void printPhase(std::FILE* out, const Phase& phase) {
+        std::fprintf(out, "%-8s %10.3f", phase.name, phase.ns / 1e6);
+        printValue(out, phase.valid[CYCLES], phase.counts[CYCLES], "%.0f");
+        printValue(out, phase.valid[INSTRUCTIONS], phase.counts[INSTRUCTIONS], "%.0f");
+        char ipc[16] = "-";
+        if (phase.valid[CYCLES] && phase.valid[INSTRUCTIONS] && phase.counts[CYCLES] > 0) {
+            std::snprintf(ipc, sizeof(ipc), "%.2f", phase.counts[INSTRUCTIONS] / phase.counts[CYCLES]);
+        }
+        std::fprintf(out, " %6s", ipc);
+        printValue(out, phase.valid[BRANCH_MISSES], phase.counts[BRANCH_MISSES], "%.0f");
+        printValue(out, phase.valid[CACHE_MISSES], phase.counts[CACHE_MISSES], "%.0f");
+        std::fprintf(out, "\n");
+    }
+
+    int fds[EVENT_COUNT];
+    int opened = 0;
+    int open_error = 0;
+    bool user_only = false;
+    Phase phases[MAX_PHASES] = {};
+    int phase_count = 0;
+    Phase* current = nullptr;
+    Reading start[EVENT_COUNT] = {};
+    uint64_t start_ns = 0;
+};
@@ -0,0 +1,154 @@
+/* reconstructs the simulator state from a trace written by simulate8089 --trace
+
+usage:
+    replay8089 <trace_file>         -> state after the last recorded step
+    replay8089 <trace_file> <step>  -> state after <step> instructions (0 = initial state)
+
+    --dump-memory <file> before the trace file also writes the 1MB memory image at that step
+*/
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <bitset>
+
+#include "trace8089.h"
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+
+static constexpr int REG_COUNT = 12;
+static constexpr const char* regNames[REG_COUNT] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "es", "cs", "ss", "ds"};
+
+static constexpr u32 MEMORY_SIZE = 1 << 20;
+static u8 memory[MEMORY_SIZE];
+
+int main(int argc, char *argv[]){
+  const char* dumpPath = nullptr;
+  int arg = 1;
+  if (argc > 2 && std::strcmp(argv[1], "--dump-memory") == 0){
+    dumpPath = argv[2];
+    arg = 3;
+  }
+  if (argc - arg != 1 && argc - arg != 2){
+    std::cerr << "Usage: " << argv[0] << " [--dump-memory <file>] <trace_file> [step]" << std::endl;
+    return 1;
+  }
+  const char* tracePath = argv[arg];
+  bool has_target = argc - arg == 2;
+  unsigned long target = has_target ? std::strtoul(argv[arg + 1], nullptr, 10) : ~0ul;
+
+  std::ifstream in(tracePath, std::ios::binary);
+  if (!in){
+    std::cerr << "Error opening file: " << tracePath << std::endl;
+    return 1;
+  }
+  std::vector<u8> buffer((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+  const u8* p = buffer.data();
+  const u8* end = p + buffer.size();
+  if (buffer.size() < 5 || std::memcmp(p, trace::MAGIC, sizeof(trace::MAGIC)) != 0
+      || p[3] != trace::VERSION || p[4] != REG_COUNT){
+    std::cerr << "Error: " << tracePath << " is not a simulate8089 trace" << std::endl;
+    return 1;
+  }
+  p += 5;
+
+  int registers[REG_COUNT];
+  uint32_t flags;
+  size_t n;
+  for (int i = 0; i < REG_COUNT; ++i){
+    n = trace::getSigned(p, end - p, registers[i]);
+    if (!n) goto truncated;
+    p += n;
+  }
+  n = trace::getUnsigned(p, end - p, flags);
+  if (!n) goto truncated;
+  p += n;
+
+  {
+    unsigned long step = 0;
+    long ip = -1;
+    while (step < target && p < end){
+      u8 kind = *p++;
+      if (kind == trace::TRACE_MEM){
+        uint32_t addr, len;
+        n = trace::getUnsigned(p, end - p, addr);
+        if (!n) goto truncated;
+        p += n;
+        n = trace::getUnsigned(p, end - p, len);
+        if (!n) goto truncated;
+        p += n;
+        if (len > size_t(end - p)) goto truncated;
+        if (addr >= MEMORY_SIZE || len > MEMORY_SIZE - addr){
+          std::cerr << "Error: memory record outside 1MB after step " << step << std::endl;
+          return 1;
+        }
+        std::memcpy(memory + addr, p, len);
+        p += len;
+        continue;
+      }
+      if (kind != trace::TRACE_STEP){
+        std::cerr << "Error: unknown record kind " << (int)kind << " after step " << step << std::endl;
+        return 1;
+      }
+
+      int32_t ip_delta;
+      n = trace::getSigned(p, end - p, ip_delta);
+      if (!n) goto truncated;
+      p += n;
+      ip += ip_delta + 1;
+
+      uint32_t mask;
+      n = trace::getUnsigned(p, end - p, mask);
+      if (!n) goto truncated;
+      p += n;
+      for (int i = 0; i < REG_COUNT; ++i){
+        if (!(mask & (1 << i))) continue;
+        int32_t delta;
+        n = trace::getSigned(p, end - p, delta);
+        if (!n) goto truncated;
+        p += n;
+        registers[i] += delta;
+      }
+
+      uint32_t flags_xor;
+      n = trace::getUnsigned(p, end - p, flags_xor);
+      if (!n) goto truncated;
+      p += n;
+      flags ^= flags_xor;
+
+      ++step;
+    }
+
+    if (has_target && step < target){
+      std::cerr << "Error: trace only has " << step << " steps" << std::endl;
+      return 1;
+    }
+
+    std::cout << "Values of registers after step " << step;
+    if (ip >= 0) std::cout << " (ip " << ip << ")";
+    std::cout << ": " << std::endl;
+    for (int i = 0; i < REG_COUNT; ++i){
+      std::cout << regNames[i] << ": " << registers[i] << std::endl;
+    }
+    std::cout << "flags: " << std::bitset<16>(flags) << std::endl;
+  }
+
+  if (dumpPath){
+    std::FILE* dump = std::fopen(dumpPath, "wb");
+    if (!dump || std::fwrite(memory, 1, MEMORY_SIZE, dump) != MEMORY_SIZE){
+      std::cerr << "Error writing file: " << dumpPath << std::endl;
+      return 1;
+    }
+    std::fclose(dump);
+  }
+  return 0;
+
+truncated:
+  std::cerr << "Error: trace is truncated" << std::endl;
+  return 1;
+}
@@ -3,12 +3,43 @@
 example:
     single_register_mov.asm -> source assembly 
     single_register_mov -> binary file 
+
+usage:
+    sim8086 <binary_file>                                -> print the disassembly
+    sim8086 --serve <socket_path> <binary_file>...       -> answer address queries over a unix socket
+    sim8086 --pipeline <binary_file>                     -> decode, format and write on three threads
+    sim8086 --perf <binary_file>                         -> print the disassembly, then hardware counters per phase
+    sim8086 --save <listing> <binary_file>               -> write a structured listing instead of text
+    sim8086 --print <listing>                            -> print the disassembly kept in a listing
+    sim8086 --incremental <old_listing> <binary_file> <new_listing> [<offset>[:<length>]]...
+                                                         -> update a listing for a patched image, re-decoding
+                                                            only the changed byte ranges (given, or found
+                                                            by comparing with the image in the listing)
 */
 #include <iostream>
-#include <fstream>
 #include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
 #include <stdexcept>
 #include <vector>
+#include <string>
+#include <deque>
+#include <algorithm>
+#include <charconv>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "mapped_file.h"
+#include "perf_counters.h"
 
 typedef uint8_t u8;
 typedef uint16_t u16;
@@ -48,735 +79,1185 @@ const char* getRegMemName(u8 mod, u8 regmem) {
     return regMemTable[mod][regmem];
 }
 
-int main(int argc, char *argv[]){
-    if (argc !=2){
-        std::cerr << "Usage: " << argv[0] << " <binary_file>" << std::endl;
-        return 1;
-    }
+/* one decoded instruction. it carries everything needed to print the instruction again, so a
+ * whole image can be decoded once into a flat array and formatted (or queried) later
+ */
+enum Mnemonic : u8 { UNKNOWN, MOV, ADD };
 
-    std::ifstream in(argv[1], std::ios::binary);
-    if (!in) {
-        std::cerr << "Error opening file: " << argv[1] << std::endl;
-        return 1;
-    }
+static constexpr const char* mnemonicNames[] = {"", "mov", "add"};
+
+enum Form : u8 {
+    REG_MEM,        // |opcode d w|mod reg r/m| (disp)
+    IMM_TO_REG,     // |opcode w reg| data
+    IMM_TO_REG_MEM  // |opcode w|mod 000 r/m| (disp) data
+};
 
-    in.seekg(0, std::ios::end);
-    std::streamsize size = in.tellg();
-    in.seekg(0, std::ios::beg);
+struct Instruction {
+    uint32_t address;
+    u8 length;
+    Mnemonic mnemonic;
+    Form form;
+    u8 d;
+    u8 w;
+    u8 mod;
+    u8 reg;
+    u8 rm;
+    int32_t disp;   // displacement, or the address itself for direct addressing
+    int32_t imm;
+};
 
-    std::vector<char> buffer(size);
-    if (!in.read(buffer.data(), size)) {
-        std::cerr << "Error: only read " << in.gcount() << " bytes" << std::endl;
-        return 1;
-    }
-    in.close();
+// number of displacement bytes that follow the mod/reg/r_m byte
+static int dispLength(u8 mod, u8 r_m) {
+    if (mod == 0b01) return 1;
+    if (mod == 0b10) return 2;
+    if (mod == 0b00 && r_m == 0b110) return 2;
+    return 0;
+}
+
+/* decodes the instruction at image[pc], the caller guarantees pc + 1 < size. returns false when
+ * the instruction runs past the end of the image. a byte that starts no supported instruction
+ * decodes as a one byte UNKNOWN instruction
+ */
+bool decodeInstruction(const u8* image, size_t size, size_t pc, Instruction& inst) {
+    const u8* p = image + pc;
+    u8 b0 = p[0];
+    u8 b1 = p[1];
+
+    inst = Instruction{};
+    inst.address = pc;
+    inst.length = 1;
 
     // process the bytes
-    // 10001001 
+    // 10001001
     //   100010 ( bit shift right by 2)
     // 00000011 ( mask for last two bits Ox03 & with 10001001)
-    
+
     // 11011001
     //       11 ( bit shift right by 6)
-    //    11011 ( bit shift right by 3, then mask with 0x07 0111) 
+    //    11011 ( bit shift right by 3, then mask with 0x07 0111)
     //      001 ( mask with 0x07)
-    
+
+    // Register/memory to/from register (mov) and add register/memory to register
+    if ((b0 >> 2) == 0b100010 || (b0 >> 2) == 0b000000) {
+        inst.mnemonic = (b0 >> 2) ? MOV : ADD;
+        inst.form = REG_MEM;
+        inst.d = (b0 >> 1) & 0x01;
+        inst.w = b0 & 0x01;
+        inst.mod = b1 >> 6;
+        inst.reg = (b1 >> 3) & 0x07;
+        inst.rm = b1 & 0x07;
+        inst.length = 2 + dispLength(inst.mod, inst.rm);
+        if (pc + inst.length > size) return false;
+
+        if (inst.mod == 0b01) {
+            inst.disp = p[2];
+        } else if (inst.mod == 0b10) {
+            inst.disp = p[3] << 8 | p[2];
+        } else if (inst.mod == 0b00 && inst.rm == 0b110) {
+            // direct address
+            if (inst.d == 0) inst.disp = u16(p[3] << 8 | p[2]);
+            else inst.disp = int16_t(p[3] << 8 | p[2]);
+        }
+        return true;
+    }
+
+    // immediate to register
+    if ((b0 >> 4) == 0b1011) {
+        inst.mnemonic = MOV;
+        inst.form = IMM_TO_REG;
+        inst.w = (b0 >> 3) & 0x01;
+        inst.reg = b0 & 0x07;
+        inst.length = 2 + inst.w;
+        if (pc + inst.length > size) return false;
+
+        // data is the next byte
+        if (inst.w == 0) inst.imm = b1;
+        else inst.imm = int16_t(p[2] << 8 | b1);
+        return true;
+    }
+
+    // immediate to register/memory add
+    if ((b0 & 0xFE) == 0x80) {
+        inst.mnemonic = ADD;
+        inst.form = IMM_TO_REG_MEM;
+        inst.w = b0 & 0x01;
+        inst.mod = b1 >> 6;
+        inst.rm = b1 & 0x07;
+        int disp_len = dispLength(inst.mod, inst.rm);
+        inst.length = 2 + disp_len + 1 + inst.w;
+        if (pc + inst.length > size) return false;
+
+        if (inst.mod == 0b01) {
+            inst.disp = int8_t(p[2]);
+        } else if (inst.mod == 0b10) {
+            inst.disp = int16_t(p[3] << 8 | p[2]);
+        } else if (inst.mod == 0b00 && inst.rm == 0b110) {
+            inst.disp = u16(p[3] << 8 | p[2]);
+        }
+
+        const u8* data = p + 2 + disp_len;
+        if (inst.w == 0) inst.imm = int8_t(data[0]);
+        else inst.imm = int16_t(data[1] << 8 | data[0]);
+        return true;
+    }
+
+    if ((b0 & 0xF0) == 0x04) {
+        // handle immediate to register add
+        inst.mnemonic = ADD;
+        inst.form = IMM_TO_REG;
+        inst.w = (b0 >> 3) & 0x01;
+        inst.reg = b0 & 0x07;
+        inst.length = 2 + inst.w;
+        if (pc + inst.length > size) return false;
+
+        if (inst.w == 0) inst.imm = b1;
+        else inst.imm = int16_t(p[2] << 8 | b1);
+        return true;
+    }
+
+    // sub (0b001010), cmp (0b001110) and jnz (0x75) are not decoded yet
+    return true;
+}
+
+/* decodes the image from the start, stopping at the first instruction that does not fit
+ */
+void decodeImage(const u8* image, size_t size, std::vector<Instruction>& out) {
     size_t pc = 0;
-    while (pc+1 < buffer.size()){
-        int inst_len = 1; // 1 bytes (default) instruction bytes    
-        u8 b0 = buffer[pc];
-        u8 b1 = buffer[pc+1];
-
-        u8 b2 = (pc + 2 < buffer.size()) ? buffer[pc+2] : 0;
-        u8 b3 = (pc + 3 < buffer.size()) ? buffer[pc+3] : 0;
-
-        // first byte decoding to understand what sort of data operation is it ? 
-        // checking first 6 bits (MOV instruction ?)
-        u8 mov_opcode = b0 >> 2;
-
-        u8 imm_mov_opcode = b0 >> 4;
-
-        u8 add_opcode = b0 >> 2;
-        u8 sub_opcode = b0 >> 2;
-        u8 cmp_opcode = b0 >> 2;
-        u8 jnz_opcode = b0;
-
-        // Register/memory to/from register
-        if (mov_opcode == 0b100010) {
-            int inst_len = 2;
-            u8 d = b0 & 0x02;
-            u8 w = b0 & 0x01; // (b0 >> 3) & 0x01;
-            // second byte decoding
-            u8 mod = b1 >> 6;
-            u8 reg = (b1 >> 3) & 0x07;
-            u8 r_m = b1 & 0x07;
-
-            if (mod == 0b01) inst_len = 3;
-            else if (mod == 0b10) inst_len = 4;
-            else if (mod == 0b00 && r_m == 0b110) inst_len = 4;
-            if (pc + inst_len - 1 >= buffer.size()) break;
-
-            std::cout << "mov ";
-
-            if (mod == 0b11) { // mod 0b11 is a register to register move
-                if (d == 0) {
-                    // reg field is the source operand
-                    // r_m field is the destination operand
-                    const char *regMemName = getRegName(w, r_m);
-                    std::cout << regMemName[0] << regMemName[1];
-                    std::cout << ", ";
-                    // get register name 
-                    const char *regName = getRegName(w, reg);
-                    std::cout << regName[0] << regName[1];
-                    std::cout << std::endl;
-                } else {
-                    // reg field is the destination operand
-                    // r_m field is the source operand
-                    const char *regName = getRegName(w, reg);
-                    std::cout << regName[0] << regName[1];
-                    std::cout << ", ";
-                    // register mode with memory displacement
-                    const char *regMemName = getRegName(w, r_m);
-                    std::cout << regMemName[0] << regMemName[1];
-                    std::cout << std::endl;
-                }
-                // |Opcode,D,W| |MOD,REG,R/M|  
-            } else if (mod == 0b00){ 
-                if (d == 0){ // reg is source so RM comes first  
-                    switch (r_m){
-                        case 0b000:
-                            std::cout << "[bx + si]";
-                            break;                                  
-                        case 0b001:
-                            std::cout << "[bx + di]";
-                            break;
-                        case 0b010:
-                            std::cout << "[bp + si]";
-                            break;
-                        case 0b011:
-                            std::cout << "[bp + di]";
-                            break;
-                        case 0b100:
-                            std::cout << "[si]";
-                            break;
-                        case 0b101:
-                            std::cout << "[di]";
-                            break;
-                        case 0b110:{
-                            u16 direct_address = u16(b3 << 8 | b2);
-                            std::cout << "[" << direct_address << "]";
-                            break;
-                        }
-                        case 0b111:
-                            std::cout << "[bx]";
-                            break;
-                    }
-                    std::cout << ", ";
-                    const char *regName = getRegName(w, reg);
-                    std::cout << regName[0] << regName[1];
-                    std::cout << std::endl;
-                } else {
-                    const char *regName = getRegName(w, reg);
-                    std::cout << regName[0] << regName[1];
-                    std::cout << ", ";
-                    switch (r_m){
-                        case 0b000:
-                            std::cout << "[bx + si]";
-                            break;
-                        case 0b001:
-                            std::cout << "[bx + di]";
-                            break;
-                        case 0b010:
-                            std::cout << "[bp + si]";
-                            break;
-                        case 0b011:
-                            std::cout << "[bp + di]";
-                            break;
-                        case 0b100:
-                            std::cout << "[si]";
-                            break;
-                        case 0b101:
-                            std::cout << "[di]";
-                            break;
-                        case 0b110:{
-                            int16_t direct_address = int16_t(b3 << 8 | b2);
-                            std::cout << "[" << direct_address << "]";
-                            break;
-                        }
-                        case 0b111:
-                            std::cout << "[bx]";
-                            break;
-                    }
-                    std::cout << std::endl;
-                }
-            } else if (mod == 0b01){
-                int b2val = (int)b2;
-                if (d == 0){
-                    switch (r_m){
-                        case 0b000:
-                            std::cout << "[bx + si + " << b2val << "]";
-                            break;
-                        case 0b001:
-                            std::cout << "[bx + di + " << b2val << "]";
-                            break;
-                        case 0b010:
-                            std::cout << "[bp + si + " << b2val << "]";
-                            break;
-                        case 0b011:
-                            std::cout << "[bp + di + " << b2val << "]";
-                            break;
-                        case 0b100:
-                            std::cout << "[si + " << b2val << "]";
-                            break;
-                        case 0b101:
-                            std::cout << "[di + " << b2val << "]";
-                            break;
-                        case 0b110:
-                            if (b2val != 0){ 
-                                std::cout << "[bp + " << b2val << "]";
-                            } else {
-                                std::cout << "[bp]";
-                            }
-                            break;
-                        case 0b111:
-                            std::cout << "[bx + " << b2val << "]";
-                            break;
-                    }
-                    std::cout << ", ";
-                    const char *regName = getRegName(w, reg);
-                    std::cout << regName[0] << regName[1];
-                    std::cout << std::endl;
-                } else {
-                    const char *regName = getRegName(w, reg);
-                    std::cout << regName[0] << regName[1];
-                    std::cout << ", ";
-                    switch (r_m){
-                        case 0b000:
-                            std::cout << "[bx + si + " << b2val << "]";
-                            break;
-                        case 0b001:
-                            std::cout << "[bx + di + " << b2val << "]";
-                            break;
-                        case 0b010:
-                            std::cout << "[bp + si + " << b2val << "]";
-                            break;
-                        case 0b011:
-                            std::cout << "[bp + di + " << b2val << "]";
-                            break;
-                        case 0b100:
-                            std::cout << "[si + " << b2val << "]";
-                            break;
-                        case 0b101:
-                            std::cout << "[di + " << b2val << "]";
-                            break;
-                        case 0b110:
-                            if (b2val != 0){ 
-                                std::cout << "[bp + " <<b2val<< "]";
-                            } else {
-                                std::cout << "[bp]";
-                            }
-                            break;
-                        case 0b111:
-                            std::cout << "[bx + " <<b2val<< "]";
-                            break;
-                    }
-                    std::cout << std::endl;
-                }
-            } else if (mod == 0b10){
-                int b3val = (int)(b3 << 8 | b2); 
-                if (d == 0){
-                    switch (r_m){
-                        case 0b000:
-                            std::cout << "[bx + si + " << b3val << "]" << std::endl;
-                            break;
-                        case 0b001:
-                            std::cout << "[bx + di + " << b3val << "]" << std::endl;
-                            break;
-                        case 0b010:
-                            std::cout << "[bp + si + " << b3val << "]" << std::endl;
-                            break;  
-                        case 0b011:
-                            std::cout << "[bp + di + " << b3val << "]" << std::endl;
-                            break;
-                        case 0b100:
-                            std::cout << "[si + " << b3val << "]" << std::endl;
-                            break;
-                        case 0b101:
-                            std::cout << "[di + " << b3val << "]" << std::endl;
-                            break;
-                        case 0b110:
-                            std::cout << "[bp + " << b3val << "]" << std::endl;
-                            break;
-                        case 0b111:
-                            std::cout << "[bx + " << b3val << "]" << std::endl;
-                            break;
-                    }
-                    std::cout << ", ";
-                    const char *regName = getRegName(w, reg);
-                    std::cout << regName[0] << regName[1];
-                    std::cout << std::endl;
-                } else {
-                    const char *regName = getRegName(w, reg);
-                    std::cout << regName[0] << regName[1];
-                    std::cout << ", ";
-                    switch (r_m){    
-                        case 0b000:
-                            std::cout << "[bx + si + " << b3val << "]";
-                            break;
-                        case 0b001:
-                            std::cout << "[bx + di + " << b3val << "]";
-                            break;
-                        case 0b010:
-                            std::cout << "[bp + si + " << b3val << "]";
-                            break;  
-                        case 0b011:
-                            std::cout << "[bp + di + " << b3val << "]";
-                            break;
-                        case 0b100:
-                            std::cout << "[si + " << b3val << "]";
-                            break;
-                        case 0b101:
-                            std::cout << "[di + " << b3val << "]";
-                            break;
-                        case 0b110:
-                            std::cout << "[bp + " << b3val << "]";
-                            break;
-                        case 0b111:
-                            std::cout << "[bx + " << b3val << "]";
-                            break;
-                    }
-                    std::cout << std::endl;
-                }
-            }
+    Instruction inst;
+    while (pc + 1 < size && decodeInstruction(image, size, pc, inst)) {
+        out.push_back(inst);
+        pc += inst.length;
+    }
+}
+
+// longest line formatInstruction can produce
+static constexpr size_t MAX_LINE = 64;
+
+// effective address of each r/m encoding (mod 00 r/m 110 is a direct address instead)
+static constexpr const char* eaBase[8] = {"bx + si", "bx + di", "bp + si", "bp + di", "si", "di", "bp", "bx"};
+
+static char* putString(char* out, const char* s) {
+    while (*s) *out++ = *s++;
+    return out;
+}
+
+static char* putRegister(char* out, u8 w, u8 reg) {
+    const char *regName = getRegName(w, reg);
+    *out++ = regName[0];
+    *out++ = regName[1];
+    return out;
+}
+
+static char* putInt(char* out, int32_t v) {
+    return std::to_chars(out, out + 12, v).ptr;
+}
+
+static char* putRegMem(char* out, const Instruction& inst) {
+    if (inst.mod == 0b11) return putRegister(out, inst.w, inst.rm);
+
+    *out++ = '[';
+    if (inst.mod == 0b00 && inst.rm == 0b110) {
+        out = putInt(out, inst.disp);
+    } else {
+        out = putString(out, eaBase[inst.rm]);
+        // [bp] only exists with a displacement, a zero 8 bit one is printed as plain [bp]
+        bool bare_bp = inst.mod == 0b01 && inst.rm == 0b110 && inst.disp == 0;
+        if (inst.mod != 0b00 && !bare_bp) {
+            out = putString(out, " + ");
+            out = putInt(out, inst.disp);
         }
+    }
+    *out++ = ']';
+    return out;
+}
 
-        // immediate to register 
-        if (imm_mov_opcode == 0b1011){
-            int inst_len = 2;
-            u8 w   = (b0 >> 3) & 0x01;
-            u8 reg = b0 & 0x07;
-
-            const char *regName = getRegName(w, reg);
-            std::cout << "mov " << regName[0] << regName[1] << ", ";
-            // data is the next byte
-            if (w == 0){
-                std::cout << (int16_t)b1 << std::endl;
+/* writes the NASM-style line for inst (including the newline) to out, which must have room
+ * for MAX_LINE characters. UNKNOWN instructions print nothing. returns the line length
+ */
+size_t formatInstruction(const Instruction& inst, char* out) {
+    if (inst.mnemonic == UNKNOWN) return 0;
+
+    char* o = putString(out, mnemonicNames[inst.mnemonic]);
+    *o++ = ' ';
+    switch (inst.form) {
+        case REG_MEM:
+            if (inst.d == 0) {
+                // reg field is the source operand, r_m field is the destination operand
+                o = putRegMem(o, inst);
+                o = putString(o, ", ");
+                o = putRegister(o, inst.w, inst.reg);
             } else {
-                std::cout << (int16_t)(b2 << 8 | b1) << std::endl;
+                o = putRegister(o, inst.w, inst.reg);
+                o = putString(o, ", ");
+                o = putRegMem(o, inst);
             }
+            break;
+        case IMM_TO_REG:
+            o = putRegister(o, inst.w, inst.reg);
+            o = putString(o, ", ");
+            o = putInt(o, inst.imm);
+            break;
+        case IMM_TO_REG_MEM:
+            o = putString(o, inst.w ? "word " : "byte ");
+            o = putRegMem(o, inst);
+            o = putString(o, ", ");
+            o = putInt(o, inst.imm);
+            break;
+    }
+    *o++ = '\n';
+    return o - out;
+}
 
+static bool writeAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
         }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
 
-        // Add register/memory to register
-        if (add_opcode == 0b000000){ 
-            int inst_len = 2;
-            u8 d = b0 & 0x02;
-            u8 w = b0 & 0x01;
-            u8 mod = b1 >> 6;
-            u8 reg = (b1 >> 3) & 0x07;
-            u8 r_m = b1 & 0x07;
-
-            if (mod == 0b01) inst_len = 3;
-            else if (mod == 0b10) inst_len = 4;
-            else if (mod == 0b00 && r_m == 0b110) inst_len = 4;
-            if (pc + inst_len - 1 >= buffer.size()) break;
-            
-            std::cout << "add ";
-            
-            // register to register
-            if (mod == 0b11) {
-                if (d == 0) {
-                    const char *regMemName = getRegName(w, r_m);
-                    std::cout << regMemName[0] << regMemName[1];
-                    std::cout << ", ";
-                    const char *regName = getRegName(w, reg);
-                    std::cout << regName[0] << regName[1];
-                } else {
-                    const char *regName = getRegName(w, reg);
-                    std::cout << regName[0] << regName[1];
-                    std::cout << ", ";
-                    const char *regMemName = getRegName(w, r_m);
-                    std::cout << regMemName[0] << regMemName[1];
-                }
-                std::cout << std::endl;
-            } else if (mod == 0b00){ 
-                if (d == 0){ // reg is source so RM comes first  
-                    switch (r_m){
-                        case 0b000:
-                            std::cout << "[bx + si]";
-                            break;                                  
-                        case 0b001:
-                            std::cout << "[bx + di]";
-                            break;
-                        case 0b010:
-                            std::cout << "[bp + si]";
-                            break;
-                        case 0b011:
-                            std::cout << "[bp + di]";
-                            break;
-                        case 0b100:
-                            std::cout << "[si]";
-                            break;
-                        case 0b101:
-                            std::cout << "[di]";
-                            break;
-                        case 0b110:{
-                            u16 direct_address = u16(b3 << 8 | b2);
-                            std::cout << "[" << direct_address << "]";
-                            break;
-                        }
-                        case 0b111:
-                            std::cout << "[bx]";
-                            break;
-                    }
-                    std::cout << ", ";
-                    const char *regName = getRegName(w, reg);
-                    std::cout << regName[0] << regName[1];
-                    std::cout << std::endl;
-                } else {
-                    const char *regName = getRegName(w, reg);
-                    std::cout << regName[0] << regName[1];
-                    std::cout << ", ";
-                    switch (r_m){
-                        case 0b000:
-                            std::cout << "[bx + si]";
-                            break;
-                        case 0b001:
-                            std::cout << "[bx + di]";
-                            break;
-                        case 0b010:
-                            std::cout << "[bp + si]";
-                            break;
-                        case 0b011:
-                            std::cout << "[bp + di]";
-                            break;
-                        case 0b100:
-                            std::cout << "[si]";
-                            break;
-                        case 0b101:
-                            std::cout << "[di]";
-                            break;
-                        case 0b110:{
-                            int16_t direct_address = int16_t(b3 << 8 | b2);
-                            std::cout << "[" << direct_address << "]";
-                            break;
-                        }
-                        case 0b111:
-                            std::cout << "[bx]";
-                            break;
-                    }
-                    std::cout << std::endl;
-                }
-            } else if (mod == 0b01){
-                int b2val = (int)b2;
-                if (d == 0){
-                    switch (r_m){
-                        case 0b000:
-                            std::cout << "[bx + si + " << b2val << "]";
-                            break;
-                        case 0b001:
-                            std::cout << "[bx + di + " << b2val << "]";
-                            break;
-                        case 0b010:
-                            std::cout << "[bp + si + " << b2val << "]";
-                            break;
-                        case 0b011:
-                            std::cout << "[bp + di + " << b2val << "]";
-                            break;
-                        case 0b100:
-                            std::cout << "[si + " << b2val << "]";
-                            break;
-                        case 0b101:
-                            std::cout << "[di + " << b2val << "]";
-                            break;
-                        case 0b110:
-                            if (b2val != 0){ 
-                                std::cout << "[bp + " << b2val << "]";
-                            } else {
-                                std::cout << "[bp]";
-                            }
-                            break;
-                        case 0b111:
-                            std::cout << "[bx + " << b2val << "]";
-                            break;
-                    }
-                    std::cout << ", ";
-                    const char *regName = getRegName(w, reg);
-                    std::cout << regName[0] << regName[1];
-                    std::cout << std::endl;
-                } else {
-                    const char *regName = getRegName(w, reg);
-                    std::cout << regName[0] << regName[1];
-                    std::cout << ", ";
-                    switch (r_m){
-                        case 0b000:
-                            std::cout << "[bx + si + " << b2val << "]";
-                            break;
-                        case 0b001:
-                            std::cout << "[bx + di + " << b2val << "]";
-                            break;
-                        case 0b010:
-                            std::cout << "[bp + si + " << b2val << "]";
-                            break;
-                        case 0b011:
-                            std::cout << "[bp + di + " << b2val << "]";
-                            break;
-                        case 0b100:
-                            std::cout << "[si + " << b2val << "]";
-                            break;
-                        case 0b101:
-                            std::cout << "[di + " << b2val << "]";
-                            break;
-                        case 0b110:
-                            if (b2val != 0){ 
-                                std::cout << "[bp + " <<b2val<< "]";
-                            } else {
-                                std::cout << "[bp]";
-                            }
-                            break;
-                        case 0b111:
-                            std::cout << "[bx + " <<b2val<< "]";
-                            break;
-                    }
-                    std::cout << std::endl;
-                }
-            } else if (mod == 0b10){
-                int b3val = (int)(b3 << 8 | b2); 
-                if (d == 0){
-                    switch (r_m){
-                        case 0b000:
-                            std::cout << "[bx + si + " << b3val << "]" << std::endl;
-                            break;
-                        case 0b001:
-                            std::cout << "[bx + di + " << b3val << "]" << std::endl;
-                            break;
-                        case 0b010:
-                            std::cout << "[bp + si + " << b3val << "]" << std::endl;
-                            break;  
-                        case 0b011:
-                            std::cout << "[bp + di + " << b3val << "]" << std::endl;
-                            break;
-                        case 0b100:
-                            std::cout << "[si + " << b3val << "]" << std::endl;
-                            break;
-                        case 0b101:
-                            std::cout << "[di + " << b3val << "]" << std::endl;
-                            break;
-                        case 0b110:
-                            std::cout << "[bp + " << b3val << "]" << std::endl;
-                            break;
-                        case 0b111:
-                            std::cout << "[bx + " << b3val << "]" << std::endl;
-                            break;
-                    }
-                    std::cout << ", ";
-                    const char *regName = getRegName(w, reg);
-                    std::cout << regName[0] << regName[1];
-                    std::cout << std::endl;
-                } else {
-                    const char *regName = getRegName(w, reg);
-                    std::cout << regName[0] << regName[1];
-                    std::cout << ", ";
-                    switch (r_m){    
-                        case 0b000:
-                            std::cout << "[bx + si + " << b3val << "]";
-                            break;
-                        case 0b001:
-                            std::cout << "[bx + di + " << b3val << "]";
-                            break;
-                        case 0b010:
-                            std::cout << "[bp + si + " << b3val << "]";
-                            break;  
-                        case 0b011:
-                            std::cout << "[bp + di + " << b3val << "]";
-                            break;
-                        case 0b100:
-                            std::cout << "[si + " << b3val << "]";
-                            break;
-                        case 0b101:
-                            std::cout << "[di + " << b3val << "]";
-                            break;
-                        case 0b110:
-                            std::cout << "[bp + " << b3val << "]";
-                            break;
-                        case 0b111:
-                            std::cout << "[bx + " << b3val << "]";
-                            break;
-                    }
-                    std::cout << std::endl;
+/* daemon mode: the images are decoded once and kept in memory, clients query them over a unix
+ * domain socket. all numbers are little endian.
+ *
+ *   request (12 bytes):  op(u8) image(u8) reserved(u16) address(u32) arg(u32)
+ *     QUERY_RANGE  instructions starting in [address, arg)
+ *     QUERY_AT     the instruction covering address (arg is ignored)
+ *     QUERY_NEXT   arg instructions starting at the first one at or after address
+ *
+ *   response:  status(u8) reserved(u8 x3) count(u32), then count records of
+ *              address(u32) length(u8) text_len(u8) text (no newline, empty for bytes that
+ *              do not decode)
+ *
+ * one response carries at most MAX_RECORDS records. a connection may send any number of
+ * requests. each request that arrives is answered by one of a small fixed pool of threads
+ */
+enum QueryOp : u8 { QUERY_RANGE = 1, QUERY_AT = 2, QUERY_NEXT = 3 };
+enum QueryStatus : u8 { STATUS_OK = 0, STATUS_BAD_REQUEST = 1, STATUS_NO_IMAGE = 2, STATUS_NOT_FOUND = 3 };
+
+static constexpr size_t REQUEST_SIZE = 12;
+static constexpr uint32_t MAX_RECORDS = 1 << 16;
+
+static uint32_t getU32(const u8* p) {
+    return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+}
+
+static void putU32(std::vector<char>& out, uint32_t v) {
+    for (int i = 0; i < 4; ++i) out.push_back(char(v >> (8 * i)));
+}
+
+static void answerQuery(const u8* req, const std::vector<std::vector<Instruction>>& images, std::vector<char>& response) {
+    u8 op = req[0];
+    u8 image = req[1];
+    uint32_t address = getU32(req + 4);
+    uint32_t arg = getU32(req + 8);
+
+    response.assign(8, 0);
+    if (image >= images.size()) {
+        response[0] = STATUS_NO_IMAGE;
+        return;
+    }
+    const std::vector<Instruction>& code = images[image];
+    auto byAddress = [](const Instruction& inst, uint32_t a) { return inst.address < a; };
+    auto first = std::lower_bound(code.begin(), code.end(), address, byAddress);
+    auto last = first;
+
+    switch (op) {
+        case QUERY_RANGE:
+            last = std::lower_bound(first, code.end(), std::max(arg, address), byAddress);
+            break;
+        case QUERY_AT:
+            if (first == code.end() || first->address != address) {
+                if (first == code.begin()) break;
+                --first;
+                if (address >= first->address + first->length) {
+                    ++first;
+                    break;
                 }
             }
+            last = first + 1;
+            break;
+        case QUERY_NEXT:
+            last = first + std::min<size_t>(arg, code.end() - first);
+            break;
+        default:
+            response[0] = STATUS_BAD_REQUEST;
+            return;
+    }
+
+    uint32_t count = std::min<size_t>(last - first, MAX_RECORDS);
+    if (count == 0) {
+        response[0] = STATUS_NOT_FOUND;
+        return;
+    }
+    response[4] = char(count);
+    response[5] = char(count >> 8);
+    response[6] = char(count >> 16);
+    response[7] = char(count >> 24);
+
+    char line[MAX_LINE];
+    for (auto it = first; it != first + count; ++it) {
+        size_t len = formatInstruction(*it, line);
+        if (len) --len;  // drop the newline
+        putU32(response, it->address);
+        response.push_back(char(it->length));
+        response.push_back(char(len));
+        response.insert(response.end(), line, line + len);
+    }
+}
+
+/* one client connection. the main thread waits for requests on all of them with epoll and
+ * hands a connection that has input to the pool; EPOLLONESHOT keeps it with that one worker
+ * until the worker rearms it, so idle clients hold no thread
+ */
+struct Connection {
+    int fd;
+    u8 req[REQUEST_SIZE];
+    size_t have = 0;  // bytes of req received so far
+};
+
+// requests a worker answers on one connection before it lets the other connections go first
+static constexpr int REQUESTS_PER_TURN = 16;
+// a client that stops reading its responses gives up its worker after this long
+static constexpr int SEND_TIMEOUT_SECONDS = 5;
+// how long the daemon stops accepting after running out of descriptors
+static constexpr int ACCEPT_BACKOFF_MS = 100;
+
+// answers the complete requests waiting on conn. returns false once the connection is done
+static bool serveRequests(Connection& conn, const std::vector<std::vector<Instruction>>& images, std::vector<char>& response) {
+    for (int served = 0; served < REQUESTS_PER_TURN;) {
+        ssize_t n = recv(conn.fd, conn.req + conn.have, sizeof(conn.req) - conn.have, MSG_DONTWAIT);
+        if (n == 0) return false;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
         }
+        conn.have += n;
+        if (conn.have < sizeof(conn.req)) continue;
+        conn.have = 0;
+        answerQuery(conn.req, images, response);
+        if (!writeAll(conn.fd, response.data(), response.size())) return false;
+        ++served;
+    }
+    return true;
+}
+
+int serve(const char* socketPath, int imageCount, char* imagePaths[]) {
+    if (imageCount > 256) {
+        std::cerr << "Error: at most 256 images can be served" << std::endl;
+        return 1;
+    }
+    std::vector<std::vector<Instruction>> images(imageCount);
+    for (int i = 0; i < imageCount; ++i) {
+        MappedFile in;
+        if (!in.open(imagePaths[i])) {
+            std::cerr << "Error opening file: " << imagePaths[i] << std::endl;
+            return 1;
+        }
+        decodeImage(reinterpret_cast<const u8*>(in.data), in.size, images[i]);
+    }
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (std::strlen(socketPath) >= sizeof(addr.sun_path)) {
+        std::cerr << "Error: socket path too long: " << socketPath << std::endl;
+        return 1;
+    }
+    std::strcpy(addr.sun_path, socketPath);
+
+    /* only a stale socket from an earlier run is replaced, never some other file and never
+     * the socket of a daemon that is still running: nobody listens on a stale one
+     */
+    struct stat existing;
+    if (lstat(socketPath, &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            std::cerr << "Error: " << socketPath << " exists and is not a socket" << std::endl;
+            return 1;
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        int probed = probe < 0 ? -1 : connect(probe, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        int error = errno;
+        if (probe >= 0) close(probe);
+        if (probed == 0) {
+            std::cerr << "Error: " << socketPath << " is already served" << std::endl;
+            return 1;
+        }
+        if (error != ECONNREFUSED) {
+            std::cerr << "Error: cannot check " << socketPath << ": " << std::strerror(error) << std::endl;
+            return 1;
+        }
+        unlink(socketPath);
+    } else if (errno != ENOENT) {
+        std::cerr << "Error: cannot check " << socketPath << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
 
-        // immediate to register/memory add
-        if ((b0 & 0xFE) == 0x80) {
-            int inst_len = 3;
-            u8 w = b0 & 0x01;
-            u8 mod = b1 >> 6;
-            u8 reg = (b1 >> 3) & 0x07;
-            u8 r_m = b1 & 0x07;
-
-            if (mod == 0b01) inst_len = 4;
-            else if (mod == 0b10) inst_len = 5;
-            else if (mod == 0b00 && r_m == 0b110) inst_len = 5;
-            if (pc + inst_len - 1 >= buffer.size()) break;
-
-            std::cout << "add ";
-            if (w == 0) std::cout << "byte ";
-            else std::cout << "word ";
-
-            if (mod == 0b11) {
-                const char *regName = getRegName(w, r_m);
-                std::cout << regName[0] << regName[1];
-            } else if (mod == 0b00) {
-                switch (r_m) {
-                    case 0b000:
-                        std::cout << "[bx + si]";
-                        break;
-                    case 0b001:
-                        std::cout << "[bx + di]";
-                        break;  
-                    case 0b010:
-                        std::cout << "[bp + si]";
-                        break;
-                    case 0b011:
-                        std::cout << "[bp + di]";
-                        break;
-                    case 0b100:
-                        std::cout << "[si]";
-                        break;
-                    case 0b101:
-                        std::cout << "[di]";
-                        break;
-                    case 0b110: {
-                        u16 direct_address = u16(buffer[pc+3] << 8 | buffer[pc+2]);
-                        std::cout << "[" << direct_address << "]";
-                        break;
-                    }
-                    case 0b111:
-                        std::cout << "[bx]";
-                        break;
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct stat bound;
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+        || listen(listener, 64) != 0 || lstat(socketPath, &bound) != 0) {
+        std::cerr << "Error listening on " << socketPath << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    // a client hanging up mid response must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    int poller = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event listen_event{};
+    listen_event.events = EPOLLIN;
+    listen_event.data.ptr = nullptr;  // connections carry their Connection
+    if (poller < 0 || epoll_ctl(poller, EPOLL_CTL_ADD, listener, &listen_event) != 0) {
+        std::cerr << "Error: epoll: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<Connection*> pending;
+    bool stopping = false;
+
+    unsigned workers = std::clamp(std::thread::hardware_concurrency(), 1u, 4u);
+    std::vector<std::thread> pool;
+    for (unsigned i = 0; i < workers; ++i) {
+        pool.emplace_back([&] {
+            std::vector<char> response;
+            while (true) {
+                Connection* conn;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    ready.wait(guard, [&] { return stopping || !pending.empty(); });
+                    if (stopping) return;
+                    conn = pending.front();
+                    pending.pop_front();
                 }
-            } else if (mod == 0b01) {
-                int8_t disp = (int8_t)buffer[pc+2];
-                switch (r_m) {
-                    case 0b000:
-                        std::cout << "[bx + si + " << (int)disp << "]";
-                        break;
-                    case 0b001:
-                        std::cout << "[bx + di + " << (int)disp << "]";
-                        break;
-                    case 0b010:
-                        std::cout << "[bp + si + " << (int)disp << "]";
-                        break;
-                    case 0b011:
-                        std::cout << "[bp + di + " << (int)disp << "]";
-                        break;
-                    case 0b100:
-                        std::cout << "[si + " << (int)disp << "]";
-                        break;
-                    case 0b101:
-                        std::cout << "[di + " << (int)disp << "]";
-                        break;
-                    case 0b110:
-                        if (disp != 0) {
-                            std::cout << "[bp + " << (int)disp << "]";
-                        } else {
-                            std::cout << "[bp]";
-                        }
-                        break;
-                    case 0b111:
-                        std::cout << "[bx + " << (int)disp << "]";
-                        break;
+                epoll_event event{};
+                event.events = EPOLLIN | EPOLLONESHOT;
+                event.data.ptr = conn;
+                if (!serveRequests(*conn, images, response) || epoll_ctl(poller, EPOLL_CTL_MOD, conn->fd, &event) != 0) {
+                    close(conn->fd);
+                    delete conn;
                 }
-            } else if (mod == 0b10) {
-                int16_t disp = (int16_t)(buffer[pc+3] << 8 | buffer[pc+2]);
-                switch (r_m) {
-                    case 0b000:
-                        std::cout << "[bx + si + " << disp << "]";
-                        break;
-                    case 0b001:
-                        std::cout << "[bx + di + " << disp << "]";
-                        break;
-                    case 0b010:
-                        std::cout << "[bp + si + " << disp << "]";
-                        break;
-                    case 0b011:
-                        std::cout << "[bp + di + " << disp << "]";
-                        break;
-                    case 0b100:
-                        std::cout << "[si + " << disp << "]";
-                        break;
-                    case 0b101:
-                        std::cout << "[di + " << disp << "]";
-                        break;
-                    case 0b110:
-                        std::cout << "[bp + " << disp << "]";
-                        break;
-                    case 0b111:
-                        std::cout << "[bx + " << disp << "]";
-                        break;
+            }
+        });
+    }
+
+    std::cerr << "serving " << imageCount << " image(s) on " << socketPath << std::endl;
+    epoll_event events[64];
+    bool accepting = true;
+    auto resume = std::chrono::steady_clock::now();
+    bool failed = false;
+    while (!failed) {
+        int wait_ms = -1;
+        if (!accepting) {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= resume) {
+                listen_event.events = EPOLLIN;
+                accepting = epoll_ctl(poller, EPOLL_CTL_MOD, listener, &listen_event) == 0;
+            }
+            if (!accepting) wait_ms = int(std::chrono::duration_cast<std::chrono::milliseconds>(resume - now).count()) + 1;
+        }
+        int n = epoll_wait(poller, events, 64, wait_ms);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "Error: epoll: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        for (int i = 0; i < n && !failed; ++i) {
+            Connection* conn = static_cast<Connection*>(events[i].data.ptr);
+            if (conn) {
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    pending.push_back(conn);
                 }
+                ready.notify_one();
+                continue;
             }
 
-            std::cout << ", ";
-            
-            if (w == 0) {
-                if (mod == 0b00 && r_m == 0b110) {
-                    std::cout << (int)buffer[pc+4];
-                } else if (mod == 0b01) {
-                    std::cout << (int)buffer[pc+3];
-                } else if (mod == 0b10) {
-                    std::cout << (int)buffer[pc+4];
-                } else {
-                    std::cout << (int)buffer[pc+2];
+            int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) continue;
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                    // out of descriptors or memory for now: stop accepting for a while, keep serving
+                    std::cerr << "Error accepting connection: " << std::strerror(errno) << ", retrying" << std::endl;
+                    listen_event.events = 0;
+                    epoll_ctl(poller, EPOLL_CTL_MOD, listener, &listen_event);
+                    accepting = false;
+                    resume = std::chrono::steady_clock::now() + std::chrono::milliseconds(ACCEPT_BACKOFF_MS);
+                    continue;
                 }
-            } else {
-                if (mod == 0b00 && r_m == 0b110) {
-                    std::cout << (int16_t)(buffer[pc+5] << 8 | buffer[pc+4]);
-                } else if (mod == 0b01) {
-                    std::cout << (int16_t)(buffer[pc+4] << 8 | buffer[pc+3]);
-                } else if (mod == 0b10) {
-                    std::cout << (int16_t)(buffer[pc+5] << 8 | buffer[pc+4]);
-                } else {
-                    std::cout << (int16_t)(buffer[pc+3] << 8 | buffer[pc+2]);
+                std::cerr << "Error accepting connection: " << std::strerror(errno) << std::endl;
+                failed = true;
+                break;
+            }
+            timeval timeout{SEND_TIMEOUT_SECONDS, 0};
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLONESHOT;
+            event.data.ptr = new Connection{fd, {}, 0};
+            if (epoll_ctl(poller, EPOLL_CTL_ADD, fd, &event) != 0) {
+                close(fd);
+                delete static_cast<Connection*>(event.data.ptr);
+            }
+        }
+    }
+
+    // only reached on a fatal error. the workers finish the request in hand and are joined
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (std::thread& worker : pool) worker.join();
+    close(listener);
+    // the path is left alone if it no longer names our socket
+    if (lstat(socketPath, &existing) == 0 && existing.st_dev == bound.st_dev && existing.st_ino == bound.st_ino) {
+        unlink(socketPath);
+    }
+    return 1;
+}
+
+/* bounded lock-free queue between exactly one producer thread and one consumer thread.
+ * push() waits while the queue is full and pop() while it is empty: a short spin for the
+ * common case where the other side is about to catch up, then the thread parks on a
+ * condition variable until the other side makes progress. the fast paths never lock
+ */
+template <typename T, size_t N>
+class SpscQueue {
+    static_assert((N & (N - 1)) == 0, "capacity must be a power of two");
+
+public:
+    void push(T value) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        waitUntil(producer_parked_, not_full_, [&] { return head - tail_.load(std::memory_order_acquire) < N; });
+        slots[head & (N - 1)] = value;
+        head_.store(head + 1, std::memory_order_release);
+        wake(consumer_parked_, not_empty_);
+    }
+
+    T pop() {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        waitUntil(consumer_parked_, not_empty_, [&] { return head_.load(std::memory_order_acquire) != tail; });
+        T value = slots[tail & (N - 1)];
+        tail_.store(tail + 1, std::memory_order_release);
+        wake(producer_parked_, not_full_);
+        return value;
+    }
+
+private:
+    static constexpr int SPIN_LIMIT = 64;
+
+    template <typename Ready>
+    void waitUntil(std::atomic<bool>& parked, std::condition_variable& cv, Ready ready) {
+        for (int spin = 0; spin < SPIN_LIMIT; ++spin) {
+            if (ready()) return;
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> guard(park_);
+        parked.store(true, std::memory_order_relaxed);
+        // pairs with the fence in wake(): either we see the other side's progress or it sees parked
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cv.wait(guard, ready);
+        parked.store(false, std::memory_order_relaxed);
+    }
+
+    void wake(std::atomic<bool>& parked, std::condition_variable& cv) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!parked.load(std::memory_order_relaxed)) return;
+        // taking the lock means the other side is either before its check or already waiting
+        { std::lock_guard<std::mutex> guard(park_); }
+        cv.notify_one();
+    }
+
+    T slots[N];
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+    alignas(64) std::atomic<bool> producer_parked_{false};
+    std::atomic<bool> consumer_parked_{false};
+    std::mutex park_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+};
+
+/* pipeline mode: a decode thread fills batches of instructions, a format thread renders them
+ * into large output blocks and the main thread writes the blocks out. batches and blocks come
+ * from fixed pools that are handed back upstream through their own queues, and a nullptr
+ * marks the end of the stream. the output is byte for byte the same as the single thread mode
+ */
+static constexpr size_t PIPELINE_DEPTH = 4;
+
+struct DecodeBatch {
+    static constexpr size_t CAPACITY = 4096;
+    Instruction insts[CAPACITY];
+    size_t count;
+};
+
+struct OutputBlock {
+    static constexpr size_t CAPACITY = 1 << 20;
+    char data[CAPACITY];
+    size_t used;
+};
+
+int runPipeline(const u8* buffer, size_t size) {
+    std::unique_ptr<DecodeBatch[]> batches(new DecodeBatch[PIPELINE_DEPTH]);
+    std::unique_ptr<OutputBlock[]> blocks(new OutputBlock[PIPELINE_DEPTH]);
+
+    SpscQueue<DecodeBatch*, PIPELINE_DEPTH> decoded, freeBatches;
+    SpscQueue<OutputBlock*, PIPELINE_DEPTH> formatted, freeBlocks;
+    for (size_t i = 0; i < PIPELINE_DEPTH; ++i) {
+        freeBatches.push(&batches[i]);
+        freeBlocks.push(&blocks[i]);
+    }
+
+    std::thread decoder([&] {
+        size_t pc = 0;
+        bool more = true;
+        while (more) {
+            DecodeBatch* batch = freeBatches.pop();
+            batch->count = 0;
+            while (batch->count < DecodeBatch::CAPACITY) {
+                Instruction& inst = batch->insts[batch->count];
+                if (!(pc + 1 < size && decodeInstruction(buffer, size, pc, inst))) {
+                    more = false;
+                    break;
                 }
+                pc += inst.length;
+                ++batch->count;
             }
-            std::cout << std::endl;
+            decoded.push(batch);
         }
+        decoded.push(nullptr);
+    });
 
-        if ((b0 & 0xF0) == 0x04) {
-            // handle immediate to register add
-            int inst_len = 2;
-            u8 w = (b0 >> 3) & 0x01;
-            u8 reg = b0 & 0x07;
+    std::thread formatter([&] {
+        OutputBlock* block = freeBlocks.pop();
+        block->used = 0;
+        while (DecodeBatch* batch = decoded.pop()) {
+            for (size_t i = 0; i < batch->count; ++i) {
+                if (block->used > OutputBlock::CAPACITY - MAX_LINE) {
+                    formatted.push(block);
+                    block = freeBlocks.pop();
+                    block->used = 0;
+                }
+                block->used += formatInstruction(batch->insts[i], block->data + block->used);
+            }
+            freeBatches.push(batch);
+        }
+        formatted.push(block);
+        formatted.push(nullptr);
+    });
 
-            const char *regName = getRegName(w, reg);
-            std::cout << "add " << regName[0] << regName[1] << ", ";
-            if (w == 0) {
-                std::cout << (int16_t)b1;
-            } else {
-                std::cout << (int16_t)(b2 << 8 | b1);
+    // the writer keeps draining after a failed write so the other stages can finish
+    bool ok = true;
+    while (OutputBlock* block = formatted.pop()) {
+        if (ok) ok = writeAll(STDOUT_FILENO, block->data, block->used);
+        freeBlocks.push(block);
+    }
+
+    decoder.join();
+    formatter.join();
+    return ok ? 0 : 1;
+}
+
+/* --perf: the same output as the default mode, but decoded, formatted and written in batches
+ * so that each phase can be counted on its own. the batches are sized to stay in cache like the
+ * default loop does. the report goes to stderr
+ */
+static constexpr size_t MEASURED_BATCH = 16384;
+
+int runMeasured(const char* path) {
+    PerfCounters perf;
+
+    perf.begin("read");
+    MappedFile in;
+    if (!in.open(path)) {
+        std::cerr << "Error opening file: " << path << std::endl;
+        return 1;
+    }
+    in.prefault();
+    perf.end(0);
+
+    const u8* buffer = reinterpret_cast<const u8*>(in.data);
+    const size_t size = in.size;
+    static Instruction batch[MEASURED_BATCH];
+    static char out[MEASURED_BATCH * MAX_LINE];
+
+    size_t pc = 0;
+    size_t count = MEASURED_BATCH;
+    while (count == MEASURED_BATCH) {
+        perf.begin("decode");
+        count = 0;
+        while (count < MEASURED_BATCH && pc + 1 < size && decodeInstruction(buffer, size, pc, batch[count])) {
+            pc += batch[count++].length;
+        }
+        perf.end(count);
+
+        perf.begin("format");
+        size_t used = 0;
+        for (size_t i = 0; i < count; ++i) {
+            used += formatInstruction(batch[i], out + used);
+        }
+        perf.end(count);
+
+        perf.begin("write");
+        bool ok = writeAll(STDOUT_FILENO, out, used);
+        perf.end(count);
+        if (!ok) return 1;
+    }
+
+    perf.report(stderr);
+    return 0;
+}
+
+/* structured listing written by --save and updated in place of a full run by --incremental.
+ * all numbers are little endian. the records have a fixed size, so a listing can be searched by
+ * address without parsing it
+ *
+ *   header (16 bytes):  "L86" version(u8) image_size(u32) record_count(u32) text_size(u32)
+ *   image:              the image_size bytes the listing was made from
+ *   records:            record_count times address(u32) length(u8) text_len(u8) reserved(u16)
+ *                       text_offset(u32), in address order
+ *   text:               text_size bytes holding the line of every record without its newline
+ *                       (empty for bytes that do not decode)
+ *
+ * --incremental keeps the old text as it is and appends the lines it re-decoded, so unchanged
+ * records are copied without touching their offsets; the lines of the replaced records stay
+ * behind unused. --save always writes a compact listing
+ */
+static constexpr char LISTING_MAGIC[3] = {'L', '8', '6'};
+static constexpr u8 LISTING_VERSION = 1;
+static constexpr size_t LISTING_HEADER = 16;
+static constexpr size_t LISTING_RECORD = 12;
+
+// read-only view of a mapped listing file
+struct Listing {
+    const u8* image = nullptr;
+    uint32_t image_size = 0;
+    const u8* records = nullptr;
+    uint32_t count = 0;
+    const char* text = nullptr;
+    uint32_t text_size = 0;
+
+    bool parse(const char* data, size_t size) {
+        const u8* p = reinterpret_cast<const u8*>(data);
+        if (size < LISTING_HEADER || std::memcmp(p, LISTING_MAGIC, sizeof(LISTING_MAGIC)) != 0
+            || p[3] != LISTING_VERSION) {
+            return false;
+        }
+        image_size = getU32(p + 4);
+        count = getU32(p + 8);
+        text_size = getU32(p + 12);
+        if (uint64_t(LISTING_HEADER) + image_size + uint64_t(count) * LISTING_RECORD + text_size != size) return false;
+        image = p + LISTING_HEADER;
+        records = image + image_size;
+        text = reinterpret_cast<const char*>(records + size_t(count) * LISTING_RECORD);
+        return true;
+    }
+
+    uint32_t address(uint32_t i) const { return getU32(records + size_t(i) * LISTING_RECORD); }
+    u8 length(uint32_t i) const { return records[size_t(i) * LISTING_RECORD + 4]; }
+    u8 textLength(uint32_t i) const { return records[size_t(i) * LISTING_RECORD + 5]; }
+    uint32_t textOffset(uint32_t i) const { return getU32(records + size_t(i) * LISTING_RECORD + 8); }
+
+    // index of the first record at or after address
+    uint32_t find(uint32_t addr) const {
+        uint32_t lo = 0, hi = count;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (address(mid) < addr) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+};
+
+/* builds the record and text sections of a listing out of new records and spans of old ones.
+ * old spans are written straight from the mapped listing they came from
+ */
+class ListingWriter {
+public:
+    // the text of old, when given, is kept at the front so its records stay valid
+    explicit ListingWriter(const Listing* old = nullptr) : old(old) {}
+
+    void add(const Instruction& inst) {
+        char line[MAX_LINE];
+        size_t len = formatInstruction(inst, line);
+        if (len) --len;  // drop the newline
+        if (pieces.empty() || pieces.back().from) pieces.push_back({nullptr, records.size(), records.size()});
+        putU32(records, inst.address);
+        records.push_back(char(inst.length));
+        records.push_back(char(len));
+        records.push_back(0);
+        records.push_back(0);
+        putU32(records, oldTextSize() + text.size());
+        pieces.back().end = records.size();
+        text.insert(text.end(), line, line + len);
+        live_text += len;
+        ++count;
+    }
+
+    // appends the old records [first, last) as they are
+    void copy(uint32_t first, uint32_t last) {
+        if (first >= last) return;
+        pieces.push_back({old->records, size_t(first) * LISTING_RECORD, size_t(last) * LISTING_RECORD});
+        count += last - first;
+        for (uint32_t i = first; i < last; ++i) live_text += old->textLength(i);
+    }
+
+    size_t size() const { return count; }
+
+    bool write(const char* path, const u8* image, uint32_t image_size) const {
+        u8 header[LISTING_HEADER];
+        std::memcpy(header, LISTING_MAGIC, sizeof(LISTING_MAGIC));
+        header[3] = LISTING_VERSION;
+        setU32(header + 4, image_size);
+        setU32(header + 8, count);
+        /* the old text is kept whole so copied records stay valid, and the lines of replaced
+         * records stay behind in it. once that dead text outweighs the live text, the records
+         * are rewritten with fresh offsets and only the lines they use are written
+         */
+        const uint64_t text_size = uint64_t(oldTextSize()) + text.size();
+        const bool compact = text_size - live_text > live_text;
+        setU32(header + 12, compact ? live_text : text_size);
+
+        /* written next to the target and renamed over it: the old listing and the image may be
+         * the very files being replaced, and they stay mapped until the write is done
+         */
+        std::string temp = std::string(path) + ".tmp";
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        bool ok = writeAll(fd, reinterpret_cast<const char*>(header), sizeof(header))
+               && writeAll(fd, reinterpret_cast<const char*>(image), image_size);
+        if (compact) {
+            ok = ok && writeCompacted(fd);
+        } else {
+            for (const Piece& piece : pieces) {
+                const char* from = piece.from ? reinterpret_cast<const char*>(piece.from) : records.data();
+                ok = ok && writeAll(fd, from + piece.begin, piece.end - piece.begin);
             }
-            std::cout << std::endl;
+            if (old) ok = ok && writeAll(fd, old->text, old->text_size);
+            ok = ok && writeAll(fd, text.data(), text.size());
+        }
+        ok = ::close(fd) == 0 && ok && ::rename(temp.c_str(), path) == 0;
+        if (!ok) ::unlink(temp.c_str());
+        return ok;
+    }
+
+private:
+    // a byte range of old->records, or of records when from is null
+    struct Piece {
+        const u8* from;
+        size_t begin;
+        size_t end;
+    };
+
+    static void setU32(u8* p, uint32_t v) {
+        for (int i = 0; i < 4; ++i) p[i] = u8(v >> (8 * i));
+    }
+
+    uint32_t oldTextSize() const { return old ? old->text_size : 0; }
+
+    template <typename Visit>
+    void forEachRecord(Visit visit) const {
+        for (const Piece& piece : pieces) {
+            const u8* from = piece.from ? piece.from : reinterpret_cast<const u8*>(records.data());
+            for (size_t at = piece.begin; at < piece.end; at += LISTING_RECORD) visit(from + at);
+        }
+    }
+
+    // the records with their text packed in record order, then the text, through a bounded buffer
+    bool writeCompacted(int fd) const {
+        static constexpr size_t FLUSH_SIZE = 1 << 20;
+        std::vector<char> buffer;
+        buffer.reserve(FLUSH_SIZE + MAX_LINE);
+        bool ok = true;
+        auto flush = [&](size_t at_least) {
+            if (buffer.size() < at_least) return;
+            ok = ok && writeAll(fd, buffer.data(), buffer.size());
+            buffer.clear();
+        };
+
+        uint32_t offset = 0;
+        forEachRecord([&](const u8* record) {
+            buffer.insert(buffer.end(), record, record + 8);
+            putU32(buffer, offset);
+            offset += record[5];
+            flush(FLUSH_SIZE);
+        });
+        forEachRecord([&](const u8* record) {
+            uint32_t from = getU32(record + 8);
+            const char* line = from < oldTextSize() ? old->text + from : text.data() + (from - oldTextSize());
+            buffer.insert(buffer.end(), line, line + record[5]);
+            flush(FLUSH_SIZE);
+        });
+        flush(0);
+        return ok;
+    }
+
+    const Listing* old;
+    std::vector<Piece> pieces;
+    std::vector<char> records;
+    std::vector<char> text;
+    size_t count = 0;
+    uint32_t live_text = 0;  // text bytes the records refer to
+};
+
+// --save: disassembles the image into a listing file
+int saveListing(const char* imagePath, const char* listingPath) {
+    MappedFile in;
+    if (!in.open(imagePath)) {
+        std::cerr << "Error opening file: " << imagePath << std::endl;
+        return 1;
+    }
+    const u8* image = reinterpret_cast<const u8*>(in.data);
+
+    ListingWriter out;
+    size_t pc = 0;
+    Instruction inst;
+    while (pc + 1 < in.size && decodeInstruction(image, in.size, pc, inst)) {
+        out.add(inst);
+        pc += inst.length;
+    }
+    if (!out.write(listingPath, image, in.size)) {
+        std::cerr << "Error writing file: " << listingPath << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// --print: the text of a listing, the same output as disassembling its image
+int printListing(const char* listingPath) {
+    MappedFile in;
+    Listing listing;
+    if (!in.open(listingPath) || !listing.parse(in.data, in.size)) {
+        std::cerr << "Error: " << listingPath << " is not a sim8086 listing" << std::endl;
+        return 1;
+    }
+
+    static char out[1 << 16];
+    size_t used = 0;
+    for (uint32_t i = 0; i < listing.count; ++i) {
+        uint32_t len = listing.textLength(i);
+        uint64_t offset = listing.textOffset(i);
+        if (len == 0) continue;
+        if (offset + len > listing.text_size) {
+            std::cerr << "Error: " << listingPath << " is corrupt" << std::endl;
+            return 1;
+        }
+        if (used > sizeof(out) - MAX_LINE) {
+            if (!writeAll(STDOUT_FILENO, out, used)) return 1;
+            used = 0;
         }
+        std::memcpy(out + used, listing.text + offset, len);
+        used += len;
+        out[used++] = '\n';
+    }
+    return writeAll(STDOUT_FILENO, out, used) ? 0 : 1;
+}
+
+struct ByteRange {
+    uint32_t start;
+    uint32_t end;
+};
+
+// <offset>[:<length>], decimal or 0x prefixed hex
+static bool parseRange(const char* text, ByteRange& range) {
+    auto number = [](const char*& p, uint32_t& value) {
+        int base = 10;
+        if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+            p += 2;
+            base = 16;
+        }
+        auto [ptr, ec] = std::from_chars(p, p + std::strlen(p), value, base);
+        bool ok = ec == std::errc() && ptr != p;
+        p = ptr;
+        return ok;
+    };
+    const char* p = text;
+    uint32_t start, length = 1;
+    if (!number(p, start)) return false;
+    if (*p == ':' && !number(++p, length)) return false;
+    if (*p != '\0' || length == 0 || start > UINT32_MAX - length) return false;
+    range = {start, start + length};
+    return true;
+}
+
+// byte ranges where the two images differ, in order
+static void diffImages(const u8* a, const u8* b, size_t size, std::vector<ByteRange>& out) {
+    static constexpr size_t BLOCK = 4096;
+    for (size_t block = 0; block < size; block += BLOCK) {
+        size_t end = std::min(size, block + BLOCK);
+        if (std::memcmp(a + block, b + block, end - block) == 0) continue;
+        for (size_t i = block; i < end; ++i) {
+            if (a[i] == b[i]) continue;
+            if (!out.empty() && out.back().end == i) out.back().end = i + 1;
+            else out.push_back({uint32_t(i), uint32_t(i + 1)});
+        }
+    }
+}
+
+/* --incremental: brings an old listing up to date with a patched image. the changed byte ranges
+ * come from the command line, or from comparing the image with the copy kept in the listing.
+ *
+ * decoding is a linear sweep, so an instruction depends only on its own bytes and the image
+ * size. each changed range is re-decoded from the old instruction that covers its first byte
+ * until the sweep, past the end of the range, lands on an address where an old instruction
+ * starts; from there on the old records are valid again and are copied as they are. work is
+ * proportional to the patched ranges, plus copying the unchanged records through
+ */
+int updateListing(const char* oldPath, const char* imagePath, const char* newPath, int rangeCount, char* rangeArgs[]) {
+    MappedFile oldFile, in;
+    Listing old;
+    if (!oldFile.open(oldPath) || !old.parse(oldFile.data, oldFile.size)) {
+        std::cerr << "Error: " << oldPath << " is not a sim8086 listing" << std::endl;
+        return 1;
+    }
+    if (!in.open(imagePath)) {
+        std::cerr << "Error opening file: " << imagePath << std::endl;
+        return 1;
+    }
+    const u8* image = reinterpret_cast<const u8*>(in.data);
+    const size_t size = in.size;
+    if (size > UINT32_MAX) {
+        std::cerr << "Error: " << imagePath << " is too large" << std::endl;
+        return 1;
+    }
 
-        // for sub instructions 
-        if (sub_opcode == 0b001010) {
-            // pass
+    std::vector<ByteRange> changed;
+    for (int i = 0; i < rangeCount; ++i) {
+        ByteRange range;
+        if (!parseRange(rangeArgs[i], range)) {
+            std::cerr << "Error: invalid byte range: " << rangeArgs[i] << std::endl;
+            return 1;
         }
+        changed.push_back(range);
+    }
+    if (rangeCount == 0) diffImages(old.image, image, std::min<size_t>(size, old.image_size), changed);
+    if (size != old.image_size) {
+        // whether the last instructions fit depends on the size, so the tail is redone
+        uint32_t common = std::min<size_t>(size, old.image_size);
+        changed.push_back({common ? common - 1 : 0, uint32_t(std::max<size_t>(size, old.image_size))});
+    }
 
-        // for cmp instructions
-        if (cmp_opcode == 0b001110) {
-            // pass 
+    /* sorted and merged. ranges are not clipped to the image: after a shrink the tail range keeps
+     * the sweep from realigning on an old record at or past the new end, and a range that starts
+     * past the end just ends the sweep there
+     */
+    std::sort(changed.begin(), changed.end(), [](const ByteRange& a, const ByteRange& b) { return a.start < b.start; });
+    std::vector<ByteRange> ranges;
+    for (ByteRange range : changed) {
+        if (!ranges.empty() && range.start <= ranges.back().end) ranges.back().end = std::max(ranges.back().end, range.end);
+        else ranges.push_back(range);
+    }
+
+    ListingWriter out(&old);
+    uint32_t next_old = 0;  // first old record that is neither copied nor replaced yet
+    size_t decoded = 0, redecoded_bytes = 0, regions = 0;
+    bool reached_end = false;
+    size_t r = 0;
+    while (r < ranges.size()) {
+        const ByteRange range = ranges[r++];
+        uint32_t end = range.end;
+
+        // start at the record covering the first changed byte, or at the end of the old sweep
+        uint32_t first = std::max(old.find(range.start + 1), next_old);
+        if (first > next_old && range.start < uint64_t(old.address(first - 1)) + old.length(first - 1)) --first;
+        out.copy(next_old, first);
+        size_t pc = first < old.count ? old.address(first)
+                  : old.count ? old.address(old.count - 1) + old.length(old.count - 1) : 0;
+        size_t start = pc;
+        uint32_t j = first;  // old records before j start before pc
+        ++regions;
+
+        while (true) {
+            Instruction inst;
+            if (pc + 1 >= size || !decodeInstruction(image, size, pc, inst)) {
+                reached_end = true;
+                break;
+            }
+            out.add(inst);
+            ++decoded;
+            pc += inst.length;
+
+            // a range the new instruction reaches into is part of this region
+            while (r < ranges.size() && ranges[r].start < pc) end = std::max(end, ranges[r++].end);
+            if (pc < end) continue;
+            while (j < old.count && old.address(j) < pc) ++j;
+            if (j < old.count && old.address(j) == pc) break;
         }
+        redecoded_bytes += pc - start;
+        next_old = j;
+        if (reached_end) break;
+    }
+    if (!reached_end) out.copy(next_old, old.count);
+
+    if (!out.write(newPath, image, size)) {
+        std::cerr << "Error writing file: " << newPath << std::endl;
+        return 1;
+    }
+    std::cerr << "re-decoded " << redecoded_bytes << " bytes (" << decoded << " instructions) in "
+              << regions << " region(s), kept " << out.size() - decoded << " of " << out.size() << " instructions" << std::endl;
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    if (argc >= 4 && std::strcmp(argv[1], "--serve") == 0) {
+        return serve(argv[2], argc - 3, argv + 3);
+    }
+    if (argc == 3 && std::strcmp(argv[1], "--perf") == 0) {
+        return runMeasured(argv[2]);
+    }
+    if (argc == 4 && std::strcmp(argv[1], "--save") == 0) {
+        return saveListing(argv[3], argv[2]);
+    }
+    if (argc == 3 && std::strcmp(argv[1], "--print") == 0) {
+        return printListing(argv[2]);
+    }
+    if (argc >= 5 && std::strcmp(argv[1], "--incremental") == 0) {
+        return updateListing(argv[2], argv[3], argv[4], argc - 5, argv + 5);
+    }
+    bool pipeline = argc == 3 && std::strcmp(argv[1], "--pipeline") == 0;
+    if (argc !=2 && !pipeline){
+        std::cerr << "Usage: " << argv[0] << " [--pipeline | --perf] <binary_file>" << std::endl;
+        std::cerr << "       " << argv[0] << " --serve <socket_path> <binary_file>..." << std::endl;
+        std::cerr << "       " << argv[0] << " --save <listing> <binary_file>" << std::endl;
+        std::cerr << "       " << argv[0] << " --print <listing>" << std::endl;
+        std::cerr << "       " << argv[0] << " --incremental <old_listing> <binary_file> <new_listing> [<offset>[:<length>]]..." << std::endl;
+        return 1;
+    }
 
-        // for jnz instructions 
-        if (jnz_opcode == 0x75) {                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                 
-            // pass 
+    const char* path = argv[argc - 1];
+    MappedFile in;
+    if (!in.open(path)) {
+        std::cerr << "Error opening file: " << path << std::endl;
+        return 1;
+    }
+
+    // decode straight out of the mapping, the image is never copied
+    const u8* buffer = reinterpret_cast<const u8*>(in.data);
+    const size_t size = in.size;
+
+    if (pipeline) {
+        return runPipeline(buffer, size);
+    }
+
+    // lines are collected and written out in large chunks
+    static char out[1 << 16];
+    size_t used = 0;
+
+    size_t pc = 0;
+    Instruction inst;
+    while (pc + 1 < size && decodeInstruction(buffer, size, pc, inst)) {
+        if (used > sizeof(out) - MAX_LINE) {
+            if (!writeAll(STDOUT_FILENO, out, used)) return 1;
+            used = 0;
         }
-        
-        pc += inst_len;
-    }   
+        used += formatInstruction(inst, out + used);
+        pc += inst.length;
+    }
+    if (!writeAll(STDOUT_FILENO, out, used)) return 1;
     return 0;
 }
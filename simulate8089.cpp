@@ -1,150 +1,1560 @@
-/*  bits -> cpu -> decoded bits into instruction -> simulate instructions 
+/*  bits -> cpu -> decoded bits into instruction -> simulate instructions
     move to/from memory to/from registers, perform some basic operations
     move out of memory
 
     in this example we expect the instructions have been decoded and now we'll just try to simulate it
+
+    usage:
+      simulate8089 <filename.asm>                        -> simulate a single machine
+      simulate8089 --batch <states_file> <filename.asm>  -> simulate one machine per line of states_file
+      simulate8089 --trace <trace_file> <filename.asm>   -> also record a binary execution trace (see replay8089)
+      simulate8089 --dump-memory <file> <filename.asm>   -> also write the 1MB memory image after the run
+      simulate8089 --timing 8086|8088 <filename.asm>     -> also estimate the clock cycles of the run
+      simulate8089 --break <line> <filename.asm>         -> dump the state before the instruction on that line runs
+      simulate8089 --watch <addr>[:<len>] <filename.asm> -> dump the state after every write to that physical range
+      simulate8089 --perf <filename.asm>                 -> also print hardware counters for each phase of the run
 */
 #include <vector>
-#include <string>
-#include <sstream>
+#include <string_view>
 #include <iostream>
-#include <fstream>
-#include <unordered_map> 
-#include <bitset> 
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <bitset>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <memory>
+#include <charconv>
+#include <optional>
+#include <type_traits>
+
+#include "mapped_file.h"
+#include "trace8089.h"
+#include "perf_counters.h"
 
 using namespace std;
 
-std::unordered_map<std::string, int> registers = {
-  {"ax", 0},
-  {"cx", 0},
-  {"dx", 0},
-  {"bx", 0},
-  {"sp", 0},
-  {"bp", 0},
-  {"si", 0},
-  {"di", 0}
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+
+// register file order matches the 8086 REG field encoding, followed by the segment registers in SR order
+enum Reg : u8 { AX, CX, DX, BX, SP, BP, SI, DI, ES, CS, SS, DS, REG_COUNT };
+
+// general purpose registers, the ones a batch states file provides
+static constexpr int GPR_COUNT = ES;
+
+static constexpr const char* regNames[REG_COUNT] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "es", "cs", "ss", "ds"};
+
+int registers[REG_COUNT] = {};
+
+// flag registers has the following order
+// D11 D10 D9 D8 D7 D6 D5 D4 D3 D2 D1 D0
+// O   D   I  T  S  Z     AC    P     CY
+std::bitset<16> flag_registers;
+
+enum Flag { CF = 0, PF = 2, AF = 4, ZF = 6, SF = 7, DF = 10, OF = 11 };
+
+// 1MB of physical memory, addressed as (segment << 4) + offset
+static constexpr u32 MEMORY_SIZE = 1 << 20;
+u8 memory[MEMORY_SIZE];
+
+// BREAK never comes from the source, it is patched over an instruction that has a breakpoint
+enum Op : u8 { MOV, ADD, SUB, CMP, MOVSB, MOVSW, STOSB, STOSW, CMPSB, SCASB, CLD, STD, BREAK };
+
+// REP doubles as REPE/REPZ for cmps and scas
+enum Rep : u8 { NO_REP, REP, REPNE };
+
+enum Operand : u8 { NO_OPERAND, REG_OPERAND, IMM_OPERAND, MEM_OPERAND };
+
+// 8086 r/m encodings of the effective addresses, EA_DIRECT is a plain [displacement]
+enum EffectiveAddress : u8 { EA_BX_SI, EA_BX_DI, EA_BP_SI, EA_BP_DI, EA_SI, EA_DI, EA_BP, EA_BX, EA_DIRECT };
+
+/* one line of the source program after parsing, so the program is parsed once
+ * and can then be executed against any number of register files
+ */
+struct Instruction {
+  Op op;
+  Rep rep;
+  Operand dst_kind;     // REG_OPERAND or MEM_OPERAND
+  Operand src_kind;
+  u8 dst;               // register index of a REG_OPERAND destination
+  u8 src;               // register index of a REG_OPERAND source
+  EffectiveAddress ea;  // address of the MEM_OPERAND, when there is one
+  bool ea_disp;         // the address includes a displacement
+  bool word;            // size of the MEM_OPERAND
+  int disp;
+  int imm;              // for BREAK, the index of the replaced instruction in the debugger
+  u32 line;             // source line, for diagnostics
 };
 
-// flag registers has the following order 
-// D7 D6 D5 D4 D3 D2 D1 D0
-// S  Z     AC    P     CY
-std::bitset<8> flag_registers;
+inline bool isStringOp(Op op){
+  return op >= MOVSB && op <= SCASB;
+}
 
-int main(int argc, char *argv[]){
-  if (argc != 2){
-    std::cerr << "Usage: " << argv[0] << " <filename.asm" << std::endl;
+/* bump allocator for the per-run structures (program, batch register files, trace ring).
+ * everything is sized once the input is loaded and released together at exit, so the
+ * parse and execute loops never touch the heap
+ */
+class Arena {
+public:
+  template <typename T>
+  T* alloc(size_t count){
+    size_t bytes = (count * sizeof(T) + 63) & ~size_t(63);
+    if (bytes > left){
+      size_t block = std::max(bytes, BLOCK_SIZE);
+      blocks.emplace_back(new u8[block + 64]);
+      // keep every allocation cache line aligned
+      next = reinterpret_cast<u8*>((reinterpret_cast<uintptr_t>(blocks.back().get()) + 63) & ~uintptr_t(63));
+      left = block;
+    }
+    T* p = reinterpret_cast<T*>(next);
+    next += bytes;
+    left -= bytes;
+    return p;
+  }
+
+private:
+  static constexpr size_t BLOCK_SIZE = 1 << 20;
+  std::vector<std::unique_ptr<u8[]>> blocks;
+  u8* next = nullptr;
+  size_t left = 0;
+};
+
+struct Program {
+  Instruction* code = nullptr;
+  size_t size = 0;
+
+  const Instruction* begin() const { return code; }
+  const Instruction* end() const { return code + size; }
+};
+
+/* every word the parser knows, interned to an id through a perfect hash: keywordHash() puts each
+ * of them in its own slot of KEYWORD_TABLE (checked at compile time), so a lookup is one hash,
+ * one length compare and one memcmp
+ */
+enum Keyword : u8 {
+  KW_NONE,
+  KW_MOV, KW_ADD, KW_SUB, KW_CMP, KW_MOVSB, KW_MOVSW, KW_STOSB, KW_STOSW, KW_CMPSB, KW_SCASB, KW_CLD, KW_STD,
+  KW_REP, KW_REPE, KW_REPZ, KW_REPNE, KW_REPNZ,
+  KW_AX, KW_CX, KW_DX, KW_BX, KW_SP, KW_BP, KW_SI, KW_DI, KW_ES, KW_CS, KW_SS, KW_DS,
+  KW_BYTE, KW_WORD, KW_BITS
+};
+
+// mnemonics map onto Op and registers onto Reg in declaration order
+static_assert(KW_STD - KW_MOV == STD - MOV && KW_DS - KW_AX == DS - AX, "keyword order");
+
+struct KeywordEntry {
+  std::string_view text;
+  Keyword id;
+};
+
+static constexpr KeywordEntry KEYWORDS[] = {
+  {"mov", KW_MOV}, {"add", KW_ADD}, {"sub", KW_SUB}, {"cmp", KW_CMP},
+  {"movsb", KW_MOVSB}, {"movsw", KW_MOVSW}, {"stosb", KW_STOSB}, {"stosw", KW_STOSW},
+  {"cmpsb", KW_CMPSB}, {"scasb", KW_SCASB}, {"cld", KW_CLD}, {"std", KW_STD},
+  {"rep", KW_REP}, {"repe", KW_REPE}, {"repz", KW_REPZ}, {"repne", KW_REPNE}, {"repnz", KW_REPNZ},
+  {"ax", KW_AX}, {"cx", KW_CX}, {"dx", KW_DX}, {"bx", KW_BX}, {"sp", KW_SP}, {"bp", KW_BP},
+  {"si", KW_SI}, {"di", KW_DI}, {"es", KW_ES}, {"cs", KW_CS}, {"ss", KW_SS}, {"ds", KW_DS},
+  {"byte", KW_BYTE}, {"word", KW_WORD}, {"bits", KW_BITS},
+};
+
+static constexpr size_t KEYWORD_TABLE_SIZE = 64;
+static constexpr size_t MAX_KEYWORD = 5;
+
+// words are lowercased and at least 2 characters long before they are hashed
+constexpr size_t keywordHash(std::string_view w){
+  return (w[0] + 2 * w[1] + 18 * w[w.size() - 1] + 14 * w.size()) & (KEYWORD_TABLE_SIZE - 1);
+}
+
+struct KeywordTable {
+  KeywordEntry slots[KEYWORD_TABLE_SIZE] = {};
+  bool perfect = true;
+
+  constexpr KeywordTable(){
+    for (const KeywordEntry& k : KEYWORDS){
+      KeywordEntry& slot = slots[keywordHash(k.text)];
+      if (slot.id != KW_NONE) perfect = false;
+      slot = k;
+    }
+  }
+};
+
+static constexpr KeywordTable KEYWORD_TABLE;
+static_assert(KEYWORD_TABLE.perfect, "keywordHash collides, pick new multipliers");
+
+Keyword lookupKeyword(std::string_view word){
+  if (word.size() < 2 || word.size() > MAX_KEYWORD) return KW_NONE;
+  char lower[MAX_KEYWORD];
+  for (size_t i = 0; i < word.size(); ++i){
+    char c = word[i];
+    lower[i] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+  }
+  std::string_view w(lower, word.size());
+  const KeywordEntry& slot = KEYWORD_TABLE.slots[keywordHash(w)];
+  return slot.text == w ? slot.id : KW_NONE;
+}
+
+inline bool isRegisterKeyword(Keyword k){
+  return k >= KW_AX && k <= KW_DS;
+}
+
+enum TokenKind : u8 { TOK_END, TOK_WORD, TOK_NUMBER, TOK_COMMA, TOK_COLON, TOK_LBRACKET, TOK_RBRACKET, TOK_PLUS, TOK_MINUS, TOK_BAD };
+
+struct Token {
+  TokenKind kind;
+  std::string_view text;
+  Keyword keyword;  // TOK_WORD only
+  int value;        // TOK_NUMBER only
+};
+
+// character classes for the lexer, one table load per character instead of a chain of compares
+enum CharClass : u8 { CH_OTHER, CH_SPACE, CH_WORD };
+
+struct CharTable {
+  CharClass cls[256] = {};
+
+  constexpr CharTable(){
+    for (char c : std::string_view(" \t\r\v\f")) cls[u8(c)] = CH_SPACE;
+    for (int c = 0; c < 256; ++c){
+      if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) cls[c] = CH_WORD;
+    }
+    for (char c : std::string_view("_.$?@")) cls[u8(c)] = CH_WORD;
+  }
+};
+
+static constexpr CharTable CHAR_TABLE;
+
+inline bool isSpace(char c){
+  return CHAR_TABLE.cls[u8(c)] == CH_SPACE;
+}
+
+inline bool isWordChar(char c){
+  return CHAR_TABLE.cls[u8(c)] == CH_WORD;
+}
+
+/* splits one source line (without its newline) into tokens, stopping at a ';' comment.
+ * numbers are decimal, 0x prefixed hex or h suffixed hex (which must start with a digit)
+ */
+class Lexer {
+public:
+  Lexer(const char* begin, const char* end) : p(begin), end(end) {}
+
+  Token next(){
+    while (p < end && isSpace(*p)) ++p;
+    if (p == end || *p == ';') return {TOK_END, {}, KW_NONE, 0};
+
+    const char* start = p;
+    char c = *p++;
+    switch (c){
+      case ',': return {TOK_COMMA, {start, 1}, KW_NONE, 0};
+      case ':': return {TOK_COLON, {start, 1}, KW_NONE, 0};
+      case '[': return {TOK_LBRACKET, {start, 1}, KW_NONE, 0};
+      case ']': return {TOK_RBRACKET, {start, 1}, KW_NONE, 0};
+      case '+': return {TOK_PLUS, {start, 1}, KW_NONE, 0};
+      case '-': return {TOK_MINUS, {start, 1}, KW_NONE, 0};
+      default: break;
+    }
+    if (!isWordChar(c)) return {TOK_BAD, {start, 1}, KW_NONE, 0};
+
+    while (p < end && isWordChar(*p)) ++p;
+    std::string_view text(start, p - start);
+    if (c < '0' || c > '9') return {TOK_WORD, text, lookupKeyword(text), 0};
+
+    Token t{TOK_NUMBER, text, KW_NONE, 0};
+    std::string_view digits = text;
+    int base = 10;
+    if (digits.size() > 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X')){
+      digits.remove_prefix(2);
+      base = 16;
+    } else if (digits.back() == 'h' || digits.back() == 'H'){
+      digits.remove_suffix(1);
+      base = 16;
+    }
+    unsigned value = 0;
+    auto [ptr, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), value, base);
+    if (ec != std::errc() || ptr != digits.data() + digits.size() || value > 0xFFFF) t.kind = TOK_BAD;
+    t.value = value;
+    return t;
+  }
+
+private:
+  const char* p;
+  const char* end;
+};
+
+/* parses one line into inst. returns 1 for an instruction, 0 for a line to skip (empty, a
+ * label only, a directive, an unsupported mnemonic or register) and -1 after reporting an error
+ */
+class LineParser {
+public:
+  LineParser(const char* begin, const char* end, u32 line) : lexer(begin, end), line(line) { advance(); }
+
+  int parse(Instruction& inst){
+    inst = Instruction{};
+    inst.line = line;
+
+    if (tok.kind == TOK_WORD && tok.keyword == KW_NONE){
+      // "label:" on its own or in front of an instruction, anything else is an unsupported mnemonic
+      advance();
+      if (tok.kind != TOK_COLON) return 0;
+      advance();
+    }
+    if (tok.kind == TOK_END) return 0;
+    if (tok.kind != TOK_WORD) return error("expected a mnemonic");
+
+    Keyword k = tok.keyword;
+    if (k >= KW_REP && k <= KW_REPNZ){
+      inst.rep = (k == KW_REPNE || k == KW_REPNZ) ? REPNE : REP;
+      advance();
+      if (tok.kind != TOK_WORD || !(tok.keyword >= KW_MOVSB && tok.keyword <= KW_SCASB)){
+        return error("rep prefix needs a string instruction");
+      }
+      k = tok.keyword;
+    }
+    if (k == KW_NONE || k == KW_BITS || k > KW_STD) return 0;
+    inst.op = Op(k - KW_MOV);
+    advance();
+
+    // string and flag instructions have no operands
+    if (inst.op >= MOVSB) return expectEnd();
+
+    int size = 0;  // 1 or 2 when a byte/word keyword was given
+    int parsed = parseOperand(inst, true, size);
+    if (parsed <= 0) return parsed;
+    if (tok.kind != TOK_COMMA) return error("expected ','");
+    advance();
+    parsed = parseOperand(inst, false, size);
+    if (parsed <= 0) return parsed;
+    if (expectEnd() < 0) return -1;
+
+    if (inst.dst_kind == MEM_OPERAND && inst.src_kind == MEM_OPERAND){
+      return error("only one operand can be in memory");
+    }
+    if (inst.dst_kind == MEM_OPERAND || inst.src_kind == MEM_OPERAND){
+      bool has_reg = inst.dst_kind == REG_OPERAND || inst.src_kind == REG_OPERAND;
+      if (has_reg && size == 1) return error("byte operands need 8 bit registers, which are not supported");
+      if (!has_reg && size == 0) return error("operation size not specified");
+      inst.word = size != 1;
+    }
     return 1;
   }
 
-  std::ifstream file(argv[1]);
-  if (!file){
-    std::cerr << "Error opening file: " << argv[1] << std::endl;
+private:
+  void advance(){
+    tok = lexer.next();
+  }
+
+  int error(const char* message){
+    std::cerr << "Error: line " << line << ": " << message;
+    if (tok.kind != TOK_END) std::cerr << " near '" << tok.text << "'";
+    std::cerr << std::endl;
+    return -1;
+  }
+
+  int expectEnd(){
+    return tok.kind == TOK_END ? 1 : error("unexpected text after the instruction");
+  }
+
+  // [+|-] number
+  bool parseNumber(int& value){
+    int sign = 1;
+    if (tok.kind == TOK_MINUS || tok.kind == TOK_PLUS){
+      if (tok.kind == TOK_MINUS) sign = -1;
+      advance();
+    }
+    if (tok.kind != TOK_NUMBER) return false;
+    value = sign * tok.value;
+    advance();
+    return true;
+  }
+
+  // same return values as parse()
+  int parseOperand(Instruction& inst, bool is_dst, int& size){
+    if (tok.kind == TOK_WORD && (tok.keyword == KW_BYTE || tok.keyword == KW_WORD)){
+      size = tok.keyword == KW_BYTE ? 1 : 2;
+      advance();
+    }
+
+    Operand kind;
+    if (tok.kind == TOK_WORD && tok.keyword == KW_NONE){
+      // 8 bit registers and symbols are not simulated, the line is skipped
+      return 0;
+    } else if (tok.kind == TOK_WORD && isRegisterKeyword(tok.keyword)){
+      kind = REG_OPERAND;
+      (is_dst ? inst.dst : inst.src) = tok.keyword - KW_AX;
+      advance();
+    } else if (tok.kind == TOK_LBRACKET){
+      kind = MEM_OPERAND;
+      advance();
+      if (!parseAddress(inst)) return -1;
+    } else {
+      kind = IMM_OPERAND;
+      if (is_dst) return error("the destination must be a register or memory");
+      if (!parseNumber(inst.imm)) return error("expected a register, memory operand or number");
+    }
+    (is_dst ? inst.dst_kind : inst.src_kind) = kind;
     return 1;
   }
-  
-  std::cout << "Values of registers before simulation: " << std::endl;
 
-  // print the register values before the start of simulation 
-  for (const auto& pair: registers){
-    std::cout << pair.first << ": " << pair.second << std::endl;
+  // inside [ ]: any order of one of bx/bp, one of si/di and displacement terms
+  bool parseAddress(Instruction& inst){
+    int base = -1, index = -1;
+    bool has_disp = false;
+    int disp = 0;
+    bool first = true;
+    while (tok.kind != TOK_RBRACKET){
+      int sign = 1;
+      if (!first || tok.kind == TOK_MINUS || tok.kind == TOK_PLUS){
+        if (tok.kind != TOK_PLUS && tok.kind != TOK_MINUS){
+          error("expected '+', '-' or ']'");
+          return false;
+        }
+        if (tok.kind == TOK_MINUS) sign = -1;
+        advance();
+      }
+      first = false;
+
+      if (tok.kind == TOK_NUMBER){
+        disp += sign * tok.value;
+        has_disp = true;
+      } else if (tok.kind == TOK_WORD && sign > 0 && (tok.keyword == KW_BX || tok.keyword == KW_BP) && base < 0){
+        base = tok.keyword - KW_AX;
+      } else if (tok.kind == TOK_WORD && sign > 0 && (tok.keyword == KW_SI || tok.keyword == KW_DI) && index < 0){
+        index = tok.keyword - KW_AX;
+      } else {
+        error("invalid effective address");
+        return false;
+      }
+      advance();
+    }
+    advance();
+
+    if (base < 0 && index < 0) inst.ea = EA_DIRECT;
+    else if (base < 0) inst.ea = index == SI ? EA_SI : EA_DI;
+    else if (index < 0) inst.ea = base == BX ? EA_BX : EA_BP;
+    else inst.ea = EffectiveAddress((base == BP ? 2 : 0) + (index == DI ? 1 : 0));
+    inst.disp = disp;
+    // [bp] has no encoding without a displacement, the assembler emits [bp + 0]
+    inst.ea_disp = (has_disp && inst.ea != EA_DIRECT) || inst.ea == EA_BP;
+    return true;
   }
-  
-  std::string line;
-  // simulate the each instruction
-  while (std::getline(file, line)){
-    if (line.empty()) continue;
 
-    std::istringstream iss(line);
-    std::string instruction, reg, val;
+  Lexer lexer;
+  Token tok;
+  u32 line;
+};
 
-    iss >> instruction >> reg >> val;
+/* parses the mapped source in place, one line at a time, into the pre-resolved program
+ */
+bool parseProgram(const MappedFile& source, Arena& arena, Program& program){
+  const char* p = source.data;
+  const char* end = p + source.size;
+
+  // every instruction takes at least one line
+  program.code = arena.alloc<Instruction>(std::count(p, end, '\n') + 1);
+  program.size = 0;
+
+  for (u32 line_no = 1; p < end; ++line_no){
+    const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    if (!eol) eol = end;
+
+    LineParser parser(p, eol, line_no);
+    int parsed = parser.parse(program.code[program.size]);
+    if (parsed < 0) return false;
+    program.size += parsed;
+    p = eol + 1;
+  }
+  return true;
+}
+
+/* whitespace separated fields of the batch states file
+ */
+std::string_view nextToken(const char*& p, const char* end){
+  while (p < end && isSpace(*p)) ++p;
+  const char* start = p;
+  while (p < end && !isSpace(*p)) ++p;
+  return std::string_view(start, p - start);
+}
+
+/* physical ranges written by the current instruction, collected only while tracing
+ */
+struct MemWrite {
+  u32 addr;
+  u32 len;
+};
+static constexpr int MAX_WRITES = 32;
+bool record_writes = false;
+MemWrite mem_writes[MAX_WRITES];
+int mem_write_count = 0;
+
+inline void noteWrite(u32 addr, u32 len){
+  if (!record_writes) return;
+  if (mem_write_count > 0){
+    MemWrite& last = mem_writes[mem_write_count - 1];
+    if (last.addr + last.len == addr){ last.len += len; return; }
+    if (addr + len == last.addr){ last.addr = addr; last.len += len; return; }
+  }
+  mem_writes[mem_write_count++] = {addr, len};
+}
+
+inline u32 physical(int seg, u16 offset){
+  return ((u32(u16(seg)) << 4) + offset) & (MEMORY_SIZE - 1);
+}
+
+// offset of a memory operand; the address wraps within the segment
+u16 effectiveOffset(const Instruction& inst){
+  int offset = inst.disp;
+  switch (inst.ea){
+    case EA_BX_SI: offset += registers[BX] + registers[SI]; break;
+    case EA_BX_DI: offset += registers[BX] + registers[DI]; break;
+    case EA_BP_SI: offset += registers[BP] + registers[SI]; break;
+    case EA_BP_DI: offset += registers[BP] + registers[DI]; break;
+    case EA_SI: offset += registers[SI]; break;
+    case EA_DI: offset += registers[DI]; break;
+    case EA_BP: offset += registers[BP]; break;
+    case EA_BX: offset += registers[BX]; break;
+    case EA_DIRECT: break;
+  }
+  return u16(offset);
+}
+
+// bp based addresses default to the stack segment, everything else to the data segment
+int operandSegment(const Instruction& inst){
+  bool bp_based = inst.ea == EA_BP_SI || inst.ea == EA_BP_DI || inst.ea == EA_BP;
+  return registers[bp_based ? SS : DS];
+}
+
+int readMemory(int seg, u16 offset, bool word){
+  int value = memory[physical(seg, offset)];
+  if (word) value |= memory[physical(seg, offset + 1)] << 8;
+  return value;
+}
+
+void writeMemory(int seg, u16 offset, bool word, int value){
+  u32 lo = physical(seg, offset);
+  memory[lo] = value & 0xFF;
+  noteWrite(lo, 1);
+  if (word){
+    u32 hi = physical(seg, offset + 1);
+    memory[hi] = (value >> 8) & 0xFF;
+    noteWrite(hi, 1);
+  }
+}
+
+/* how many size byte elements, starting at offset and walking up (or down), stay clear of
+ * both the 16 bit offset wrap and the 1MB wrap. 0 when the element at offset straddles one
+ */
+u32 contiguousElements(int seg, u16 offset, u32 size, bool down){
+  u32 phys = physical(seg, offset);
+  if (!down){
+    return std::min((0x10000 - offset) / size, (MEMORY_SIZE - phys) / size);
+  }
+  if (offset + size > 0x10000 || phys + size > MEMORY_SIZE) return 0;
+  return std::min(offset / size + 1, phys / size + 1);
+}
+
+// fills dst[period..len) by repeating dst[0..period), doubling the copied block each round
+void repeatUp(u8* dst, u32 period, u32 len){
+  for (u32 done = period; done < len; ){
+    u32 n = std::min(done, len - done);
+    std::memcpy(dst + done, dst, n);
+    done += n;
+  }
+}
+
+// same, but the pattern is the top period bytes and it is repeated downwards
+void repeatDown(u8* dst, u32 period, u32 len){
+  for (u32 done = period; done < len; ){
+    u32 n = std::min(done, len - done);
+    std::memcpy(dst + len - done - n, dst + len - n, n);
+    done += n;
+  }
+}
 
-    if (reg.back() == ','){
-      reg.pop_back();
+/* movs over a run that wraps nowhere. src and dst are the physical addresses of the lowest byte.
+ * the 8086 copies one element at a time, so when the destination overlaps the part of the
+ * source that is still to be read, the bytes already copied are read again and the first
+ * (dst - src) bytes repeat. that is what repeatUp/repeatDown reproduce; every other layout
+ * behaves like memmove
+ */
+void moveRun(u32 src, u32 dst, u32 len, u32 size, bool down){
+  u8* s = memory + src;
+  u8* d = memory + dst;
+  bool repeats = down ? (dst < src && dst + len > src) : (dst > src && dst < src + len);
+  if (!repeats){
+    std::memmove(d, s, len);
+    return;
+  }
+
+  u32 period = down ? src - dst : dst - src;
+  if (size == 2 && period == 1){
+    // a word reads both source bytes before writing, so a one byte shift is not a byte repeat
+    if (!down){
+      for (u32 i = 0; i < len; i += 2){ u8 lo = s[i], hi = s[i + 1]; d[i] = lo; d[i + 1] = hi; }
+    } else {
+      for (u32 i = len; i > 0; i -= 2){ u8 lo = s[i - 2], hi = s[i - 1]; d[i - 2] = lo; d[i - 1] = hi; }
+    }
+  } else if (!down){
+    std::memcpy(d, s, period);
+    repeatUp(d, period, len);
+  } else {
+    std::memcpy(d + len - period, s + len - period, period);
+    repeatDown(d, period, len);
+  }
+}
+
+void setCompareFlags(u8 a, u8 b){
+  u8 r = a - b;
+  flag_registers[CF] = a < b;
+  flag_registers[PF] = !__builtin_parity(r);
+  flag_registers[AF] = ((a ^ b ^ r) & 0x10) != 0;
+  flag_registers[ZF] = r == 0;
+  flag_registers[SF] = (r & 0x80) != 0;
+  flag_registers[OF] = ((a ^ b) & (a ^ r) & 0x80) != 0;
+}
+
+/* index (in execution order) of the first element that ends a repe/repne, or run when none does.
+ * a and b point at the lowest byte of the run
+ */
+u32 findStop(const u8* a, const u8* b, u32 run, bool down, Rep rep){
+  bool stop_on_equal = rep == REPNE;
+  if (!down){
+    u32 i = 0;
+    if (!stop_on_equal){
+      // skip equal blocks with memcmp before looking for the exact byte
+      while (i + 64 <= run && std::memcmp(a + i, b + i, 64) == 0) i += 64;
+    }
+    while (i < run && (a[i] == b[i]) != stop_on_equal) ++i;
+    return i;
+  }
+  u32 i = 0;
+  while (i < run && (a[run - 1 - i] == b[run - 1 - i]) != stop_on_equal) ++i;
+  return i;
+}
+
+u32 findStopScan(const u8* b, u8 al, u32 run, bool down, Rep rep){
+  if (rep == REPNE){
+    const void* hit = down ? memrchr(b, al, run) : std::memchr(b, al, run);
+    if (!hit) return run;
+    u32 at = static_cast<const u8*>(hit) - b;
+    return down ? run - 1 - at : at;
+  }
+  u32 i = 0;
+  while (i < run && b[down ? run - 1 - i : i] == al) ++i;
+  return i;
+}
+
+/* runs a string instruction with all of its rep iterations at once. the iterations are split
+ * into runs that cross no segment offset wrap and no 1MB wrap; each run is one bulk memory
+ * operation and the rare word that straddles a wrap is copied byte by byte
+ */
+void executeString(const Instruction& inst){
+  const u32 size = (inst.op == MOVSW || inst.op == STOSW) ? 2 : 1;
+  const bool down = flag_registers[DF];
+  const bool uses_si = inst.op == MOVSB || inst.op == MOVSW || inst.op == CMPSB;
+  const int ds = registers[DS];
+  const int es = registers[ES];
+  u16 si = registers[SI];
+  u16 di = registers[DI];
+  u32 count = inst.rep != NO_REP ? u16(registers[CX]) : 1;
+
+  while (count > 0){
+    u32 run = std::min(count, contiguousElements(es, di, size, down));
+    if (uses_si) run = std::min(run, contiguousElements(ds, si, size, down));
+    bool stopped = false;
+
+    if (run == 0){
+      // only words can straddle a wrap, and cmpsb/scasb are byte sized
+      run = 1;
+      u8 value[2];
+      for (u16 k = 0; k < size; ++k){
+        value[k] = inst.op == MOVSW ? memory[physical(ds, si + k)] : u8(registers[AX] >> (8 * k));
+      }
+      for (u16 k = 0; k < size; ++k){
+        u32 to = physical(es, di + k);
+        memory[to] = value[k];
+        noteWrite(to, 1);
+      }
+    } else {
+      u32 len = run * size;
+      u32 src = physical(ds, si) - (down ? len - size : 0);
+      u32 dst = physical(es, di) - (down ? len - size : 0);
+      switch (inst.op){
+        case MOVSB:
+        case MOVSW:
+          moveRun(src, dst, len, size, down);
+          noteWrite(dst, len);
+          break;
+        case STOSB:
+          std::memset(memory + dst, registers[AX] & 0xFF, len);
+          noteWrite(dst, len);
+          break;
+        case STOSW:
+          memory[dst] = registers[AX] & 0xFF;
+          memory[dst + 1] = (registers[AX] >> 8) & 0xFF;
+          repeatUp(memory + dst, 2, len);
+          noteWrite(dst, len);
+          break;
+        case CMPSB: {
+          u32 i = findStop(memory + src, memory + dst, run, down, inst.rep);
+          stopped = i < run;
+          if (stopped) run = i + 1;
+          u32 last = down ? len - run : run - 1;
+          setCompareFlags(memory[src + last], memory[dst + last]);
+          break;
+        }
+        case SCASB: {
+          u8 al = registers[AX] & 0xFF;
+          u32 i = findStopScan(memory + dst, al, run, down, inst.rep);
+          stopped = i < run;
+          if (stopped) run = i + 1;
+          u32 last = down ? len - run : run - 1;
+          setCompareFlags(al, memory[dst + last]);
+          break;
+        }
+        default:
+          break;
+      }
+    }
+
+    u16 delta = run * size;
+    if (uses_si) si = down ? si - delta : si + delta;
+    di = down ? di - delta : di + delta;
+    count -= run;
+    if (stopped) break;
+  }
+
+  if (uses_si) registers[SI] = si;
+  registers[DI] = di;
+  if (inst.rep != NO_REP) registers[CX] = count;
+}
+
+// zf and sf of a result at the operand width of a memory form: bit 15 is the sign of a word
+void setResultFlags(int result, bool word){
+  const int mask = word ? 0xFFFF : 0xFF;
+  flag_registers[ZF] = (result & mask) == 0;
+  flag_registers[SF] = (result & (word ? 0x8000 : 0x80)) != 0;
+}
+
+// arithmetic with a memory destination
+void executeMemory(const Instruction& inst, int val){
+  const int seg = operandSegment(inst);
+  const u16 offset = effectiveOffset(inst);
+
+  if (inst.op == MOV){
+    writeMemory(seg, offset, inst.word, val);
+    return;
+  }
+
+  int cur = readMemory(seg, offset, inst.word);
+  int result = inst.op == ADD ? cur + val : cur - val;
+  if (inst.op != CMP) writeMemory(seg, offset, inst.word, result & (inst.word ? 0xFFFF : 0xFF));
+  setResultFlags(result, inst.word);
+}
+
+void execute(const Instruction& inst){
+  if (inst.op >= MOVSB){
+    if (inst.op == CLD) flag_registers[DF] = false;
+    else if (inst.op == STD) flag_registers[DF] = true;
+    else executeString(inst);
+    return;
+  }
+
+  int val;
+  switch (inst.src_kind){
+    case REG_OPERAND: val = registers[inst.src]; break;
+    case MEM_OPERAND: val = readMemory(operandSegment(inst), effectiveOffset(inst), inst.word); break;
+    default: val = inst.imm; break;
+  }
+  if (inst.dst_kind == MEM_OPERAND){
+    executeMemory(inst, val);
+    return;
+  }
+  int& reg = registers[inst.dst];
+
+  switch (inst.op){
+    case MOV:
+      reg = val;
+      break;
+    case ADD:
+    case SUB: {
+      if (inst.op == ADD) reg += val;
+      else reg -= val;
+
+      if (inst.src_kind == MEM_OPERAND){
+        setResultFlags(reg, true);
+        break;
+      }
+
+      // set flags
+      flag_registers[6] = (reg == 0);
+      uint8_t result = static_cast<uint8_t>(reg);
+      flag_registers[7] = (result & (1<<7)) != 0;
+      break;
     }
-    
-    // std::cout << "Inst: " << instruction << ", Reg: " << reg << ", Val: " << val << std::endl;
-    if (instruction == "mov"){
-      if (registers.find(val) != registers.end()){
-        // register to register move
-        registers[reg] = registers[val];
+    case CMP: {
+      if (inst.src_kind == MEM_OPERAND){
+        setResultFlags(reg - val, true);
+        break;
+      }
+      uint8_t temp_val = reg - val;
+      flag_registers[6] = (temp_val == 0);
+      // temp_val is unsigned so the sign flag is never raised by cmp
+      flag_registers[7] = false;
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+/* cycle accounting policies, run() takes one as a template parameter and calls before() and
+ * after() around every instruction. NoTiming's hooks are empty inline functions, so run<NoTiming>
+ * compiles to the same loop as an engine without any timing
+ */
+struct NoTiming {
+  static constexpr bool enabled = false;
+  void before(const Instruction&){}
+  void after(const Instruction&){}
+};
+
+/* clock counts from the 8086 family user's manual. the 8088 has an 8 bit bus and pays 4 extra
+ * clocks for every word transfer; the 8086 only does for a word at an odd address
+ */
+template <bool Bus8088>
+struct BusTiming {
+  static constexpr bool enabled = true;
+  static constexpr const char* name = Bus8088 ? "8088" : "8086";
+
+  uint64_t cycles = 0;
+
+  /* effective address clocks by r/m encoding (bx+si, bx+di, bp+si, bp+di, si, di, bp, bx),
+   * without and with a displacement. a direct address costs DIRECT_EA_CLOCKS
+   */
+  static constexpr u8 EA_CLOCKS[2][8] = {{7, 8, 8, 7, 5, 5, 5, 5}, {11, 12, 12, 11, 9, 9, 9, 9}};
+  static constexpr u8 DIRECT_EA_CLOCKS = 6;
+
+  void before(const Instruction& inst){
+    if (isStringOp(inst.op)){
+      cx = registers[CX];
+      si = registers[SI];
+      di = registers[DI];
+    } else if (inst.dst_kind == MEM_OPERAND || inst.src_kind == MEM_OPERAND){
+      // the address has to be taken before the instruction changes its registers
+      ea = effectiveOffset(inst);
+    }
+  }
+
+  void after(const Instruction& inst){
+    cycles += clocks(inst);
+  }
+
+private:
+  u16 cx = 0;
+  u16 si = 0;
+  u16 di = 0;
+  u16 ea = 0;
+
+  static u32 wordPenalty(u16 offset){
+    return (Bus8088 || (offset & 1)) ? 4 : 0;
+  }
+
+  u32 memoryClocks(const Instruction& inst) const {
+    bool to_memory = inst.dst_kind == MEM_OPERAND;
+    // mov between ax and a direct address assembles to the accumulator form (a1/a3): 10 clocks, no ea
+    if (inst.op == MOV && inst.ea == EA_DIRECT
+        && (to_memory ? inst.src_kind == REG_OPERAND && inst.src == AX : inst.dst == AX)){
+      return 10 + wordPenalty(ea);
+    }
+    u32 ea_clocks = inst.ea == EA_DIRECT ? DIRECT_EA_CLOCKS : EA_CLOCKS[inst.ea_disp][inst.ea];
+    u32 base, transfers;
+    switch (inst.op){
+      case MOV:
+        base = !to_memory ? 8 : inst.src_kind == REG_OPERAND ? 9 : 10;
+        transfers = 1;
+        break;
+      case CMP:
+        base = !to_memory || inst.src_kind == REG_OPERAND ? 9 : 10;
+        transfers = 1;
+        break;
+      default:
+        // add/sub read and write back a memory destination
+        base = !to_memory ? 9 : inst.src_kind == REG_OPERAND ? 16 : 17;
+        transfers = to_memory ? 2 : 1;
+        break;
+    }
+    return base + ea_clocks + (inst.word ? transfers * wordPenalty(ea) : 0);
+  }
+
+  u32 clocks(const Instruction& inst) const {
+    if (inst.op < MOVSB && (inst.dst_kind == MEM_OPERAND || inst.src_kind == MEM_OPERAND)){
+      return memoryClocks(inst);
+    }
+    switch (inst.op){
+      case MOV:
+        return inst.src_kind == REG_OPERAND ? 2 : 4;
+      case ADD:
+      case SUB:
+      case CMP:
+        return inst.src_kind == REG_OPERAND ? 3 : 4;
+      case CLD:
+      case STD:
+        return 2;
+      default:
+        break;
+    }
+
+    // string instructions: {without rep, per rep iteration}. si/di keep their parity from one
+    // iteration to the next, so the odd address penalty is the same for every iteration
+    u32 single = 0, per = 0, penalty = 0;
+    switch (inst.op){
+      case MOVSB: single = 18; per = 17; break;
+      case MOVSW: single = 18; per = 17; penalty = wordPenalty(si) + wordPenalty(di); break;
+      case STOSB: single = 11; per = 10; break;
+      case STOSW: single = 11; per = 10; penalty = wordPenalty(di); break;
+      case CMPSB: single = 22; per = 22; break;
+      case SCASB: single = 15; per = 15; break;
+      default: break;
+    }
+    if (inst.rep == NO_REP) return single + penalty;
+    u32 iterations = u16(cx - registers[CX]);
+    return 9 + iterations * (per + penalty);
+  }
+};
+
+typedef BusTiming<false> Timing8086;
+typedef BusTiming<true> Timing8088;
+
+void printRegisters(){
+  for (int i = 0; i < REG_COUNT; ++i){
+    std::cout << regNames[i] << ": " << registers[i] << std::endl;
+  }
+}
+
+/* debugger policies, run() takes one next to the timing policy. NoDebug hands every instruction
+ * straight through, so a run without breakpoints or watchpoints is the same loop as before
+ */
+struct NoDebug {
+  const Instruction& fetch(const Instruction& inst){ return inst; }
+  void after(const Instruction&){}
+};
+
+/* breakpoints patch the predecoded entry of their line with a BREAK that indexes the saved
+ * original, so the only check is on the op byte the loop loads anyway. watchpoints cover
+ * physical address ranges; the writes every instruction records are checked against a bitmap
+ * of watched pages and only a write to a flagged page looks at the watchpoints themselves
+ */
+class Debugger {
+public:
+  // false when no instruction comes from that line
+  bool addBreakpoint(Program& program, u32 line){
+    Instruction* inst = std::lower_bound(program.code, program.code + program.size, line,
+        [](const Instruction& i, u32 l){ return i.line < l; });
+    if (inst == program.code + program.size || inst->line != line) return false;
+    if (inst->op == BREAK) return true;
+
+    Instruction patch{};
+    patch.op = BREAK;
+    patch.imm = originals.size();
+    patch.line = line;
+    originals.push_back(*inst);
+    *inst = patch;
+    return true;
+  }
+
+  void addWatchpoint(u32 addr, u32 len){
+    watchpoints.push_back({addr, len});
+    for (u32 page = addr >> WATCH_PAGE_BITS; page <= (addr + len - 1) >> WATCH_PAGE_BITS; ++page){
+      watched_pages[page] = true;
+    }
+    record_writes = true;
+  }
+
+  const Instruction& fetch(const Instruction& inst){
+    mem_write_count = 0;
+    if (inst.op != BREAK) return inst;
+    std::cout << "Breakpoint at line " << inst.line << ": " << std::endl;
+    printState();
+    return originals[inst.imm];
+  }
+
+  void after(const Instruction& inst){
+    for (int i = 0; i < mem_write_count; ++i){
+      const MemWrite& w = mem_writes[i];
+      u32 last = (w.addr + w.len - 1) >> WATCH_PAGE_BITS;
+      for (u32 page = w.addr >> WATCH_PAGE_BITS; page <= last; ++page){
+        if (watched_pages[page]){
+          checkWatchpoints(inst, w);
+          break;
+        }
+      }
+    }
+  }
+
+private:
+  static constexpr u32 WATCH_PAGE_BITS = 8;
+
+  struct Watchpoint {
+    u32 addr;
+    u32 len;
+  };
+
+  void checkWatchpoints(const Instruction& inst, const MemWrite& w){
+    for (const Watchpoint& watch : watchpoints){
+      if (watch.addr >= w.addr + w.len || w.addr >= watch.addr + watch.len) continue;
+      char addr[12];
+      std::snprintf(addr, sizeof(addr), "0x%05X", watch.addr);
+      std::cout << "Watchpoint " << addr << " (" << watch.len << " bytes) written at line " << inst.line << ":";
+      for (u32 i = 0; i < std::min<u32>(watch.len, 16); ++i){
+        char byte[4];
+        std::snprintf(byte, sizeof(byte), " %02X", memory[watch.addr + i]);
+        std::cout << byte;
+      }
+      std::cout << std::endl;
+      printState();
+    }
+  }
+
+  static void printState(){
+    printRegisters();
+    std::cout << "flags: " << flag_registers << std::endl;
+  }
+
+  std::vector<Instruction> originals;
+  std::vector<Watchpoint> watchpoints;
+  std::bitset<(MEMORY_SIZE >> WATCH_PAGE_BITS)> watched_pages;
+};
+
+template <typename Timing, typename Debug>
+void run(const Program& program, Timing& timing, Debug& debug){
+  for (const Instruction& slot : program){
+    const Instruction& inst = debug.fetch(slot);
+    timing.before(inst);
+    execute(inst);
+    timing.after(inst);
+    debug.after(inst);
+  }
+}
+
+/* N independent machines stored as structure-of-arrays: regs[r][lane]. the program has no
+ * control flow, so every lane runs the same instruction stream and no lane can diverge;
+ * string instructions and memory operands need a memory image per lane and are not supported here.
+ * each instruction becomes one straight loop over the lanes that the compiler vectorizes
+ * (build with -O3 -march=native). flag semantics are identical to execute()
+ */
+struct BatchMachines {
+  size_t lanes = 0;
+  int* regs[REG_COUNT];
+  u8* zf;
+  u8* sf;
+};
+
+void executeBatch(const Instruction& inst, BatchMachines& m){
+  const size_t n = m.lanes;
+  int* dst = m.regs[inst.dst];
+  const int* src = m.regs[inst.src];
+  u8* zf = m.zf;
+  u8* sf = m.sf;
+  const int imm = inst.imm;
+
+  switch (inst.op){
+    case MOV:
+      if (inst.src_kind == REG_OPERAND) std::memmove(dst, src, n * sizeof(int));
+      else for (size_t i = 0; i < n; ++i) dst[i] = imm;
+      break;
+    case ADD:
+      if (inst.src_kind == REG_OPERAND){
+        for (size_t i = 0; i < n; ++i){
+          int r = dst[i] + src[i];
+          dst[i] = r; zf[i] = (r == 0); sf[i] = (r >> 7) & 1;
+        }
+      } else {
+        for (size_t i = 0; i < n; ++i){
+          int r = dst[i] + imm;
+          dst[i] = r; zf[i] = (r == 0); sf[i] = (r >> 7) & 1;
+        }
+      }
+      break;
+    case SUB:
+      if (inst.src_kind == REG_OPERAND){
+        for (size_t i = 0; i < n; ++i){
+          int r = dst[i] - src[i];
+          dst[i] = r; zf[i] = (r == 0); sf[i] = (r >> 7) & 1;
+        }
       } else {
-        // immediate
-        registers[reg] = stoi(val);
+        for (size_t i = 0; i < n; ++i){
+          int r = dst[i] - imm;
+          dst[i] = r; zf[i] = (r == 0); sf[i] = (r >> 7) & 1;
+        }
+      }
+      break;
+    case CMP:
+      if (inst.src_kind == REG_OPERAND){
+        for (size_t i = 0; i < n; ++i){
+          zf[i] = (u8)(dst[i] - src[i]) == 0; sf[i] = 0;
+        }
+      } else {
+        for (size_t i = 0; i < n; ++i){
+          zf[i] = (u8)(dst[i] - imm) == 0; sf[i] = 0;
+        }
+      }
+      break;
+    default:
+      // cld/std only change the direction flag, which nothing in batch mode reads
+      break;
+  }
+}
+
+/* states file: one machine per line, GPR_COUNT whitespace separated initial values in ax..di order
+ * (segment registers start at 0).
+ * final states are written to stdout in the same format, one machine per line
+ */
+int runBatch(const char* statesPath, const Program& program, Arena& arena){
+  for (const Instruction& inst : program){
+    if (isStringOp(inst.op) || inst.dst_kind == MEM_OPERAND || inst.src_kind == MEM_OPERAND){
+      std::cerr << "Error: line " << inst.line << ": memory is not supported in batch mode" << std::endl;
+      return 1;
+    }
+  }
+
+  MappedFile states;
+  if (!states.open(statesPath)){
+    std::cerr << "Error opening file: " << statesPath << std::endl;
+    return 1;
+  }
+  const char* p = states.data;
+  const char* end = p + states.size;
+
+  // one machine per line, so the line count bounds the number of lanes
+  size_t capacity = std::count(p, end, '\n') + 1;
+  BatchMachines m;
+  for (int i = 0; i < REG_COUNT; ++i){
+    m.regs[i] = arena.alloc<int>(capacity);
+    std::memset(m.regs[i], 0, capacity * sizeof(int));
+  }
+
+  for (size_t line_no = 1; p < end; ++line_no){
+    const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    if (!eol) eol = end;
+
+    int r = 0;
+    for (std::string_view value = nextToken(p, eol); !value.empty(); value = nextToken(p, eol), ++r){
+      int v;
+      auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), v);
+      if (ec != std::errc() || ptr != value.data() + value.size() || r == GPR_COUNT){
+        r = -1;
+        break;
       }
-    } else if (instruction == "sub") {
-       if (registers.find(val) != registers.end()){
-        // register to register
-        registers[reg] -= registers[val];
-       } else {
-        // immediate
-        registers[reg] -= stoi(val);    
-       }
-       
-       // set flags 
-       if (registers[reg] == 0){
-          flag_registers[6] = true;
-       } else {
-         flag_registers[6] = false;
-       }
-
-       uint8_t result = static_cast<uint8_t>(registers[reg]);
-       if (result & (1<<7)) {
-          flag_registers[7] = true;
-       } else {
-         flag_registers[7]  = false;
-       }
-    } else if (instruction == "add") {
-       if (registers.find(val) != registers.end()){
-        // register to register
-        registers[reg] += registers[val];
-       } else {
-        // immediate
-        registers[reg] += stoi(val);    
-       }
-       
-       // set flags 
-       if (registers[reg] == 0){
-          flag_registers[6] = true;
-       } else {
-         flag_registers[6] = false;
-       }
-
-       uint8_t result = static_cast<uint8_t>(registers[reg]);
-       if (result & (1<<7)) {
-          flag_registers[7] = true;
-       } else {
-         flag_registers[7]  = false;
-       }
-    } else if (instruction == "cmp"){
-       uint8_t temp_val {0};
-       if (registers.find(val) != registers.end()){
-        // register to register subregisters
-        temp_val = registers[reg] - registers[val];
-       } else {
-        // immediate
-        temp_val = registers[reg] - stoi(val);    
-       }
-       
-       // set flags 
-       if (temp_val == 0){
-          flag_registers[6] = true;
-       } else {
-          flag_registers[6] = false;
-       }
-
-       if (temp_val < 0) {
-          flag_registers[7] = true;
-       } else {
-          flag_registers[7]  = false;
-       }
+      m.regs[r][m.lanes] = v;
+    }
+    p = eol + 1;
+
+    if (r == 0) continue;
+    if (r != GPR_COUNT){
+      std::cerr << "Error: " << statesPath << ": line " << line_no << " needs " << GPR_COUNT << " register values" << std::endl;
+      return 1;
     }
+    ++m.lanes;
   }
-  std::cout << "Values of registers after simulation: " << std::endl;
-  for (const auto& pair: registers){
-    std::cout << pair.first << ": " << pair.second << std::endl;
+  m.zf = arena.alloc<u8>(m.lanes);
+  m.sf = arena.alloc<u8>(m.lanes);
+  std::memset(m.zf, 0, m.lanes);
+  std::memset(m.sf, 0, m.lanes);
+
+  for (const Instruction& inst : program){
+    executeBatch(inst, m);
   }
 
+  // worst case "-2147483648 " per register
+  char* out = arena.alloc<char>(m.lanes * GPR_COUNT * 12);
+  char* o = out;
+  for (size_t lane = 0; lane < m.lanes; ++lane){
+    for (int i = 0; i < GPR_COUNT; ++i){
+      o = std::to_chars(o, o + 11, m.regs[i][lane]).ptr;
+      *o++ = i + 1 < GPR_COUNT ? ' ' : '\n';
+    }
+  }
+  std::cout.write(out, o - out);
   return 0;
 }
 
+/* single producer / single consumer byte ring between the simulator and the trace writer
+ * thread. a full ring makes the simulator wait for the writer, records are never dropped.
+ * either side waiting spins briefly, then parks on a condition variable until the other side
+ * makes progress (the same scheme as sim8086's SpscQueue), so a slow disk costs no cpu
+ */
+class TraceRing {
+public:
+  TraceRing(u8* buf, size_t capacity) : buf(buf), capacity(capacity), mask(capacity - 1) {}
+
+  void push(const u8* data, size_t len){
+    size_t head = head_.load(std::memory_order_relaxed);
+    while (len > 0){
+      waitUntil(producer_parked_, not_full_, [&]{ return head - tail_.load(std::memory_order_acquire) < capacity; });
+      size_t free = capacity - (head - tail_.load(std::memory_order_acquire));
+      size_t n = std::min({len, free, capacity - (head & mask)});
+      std::memcpy(&buf[head & mask], data, n);
+      head += n;
+      data += n;
+      len -= n;
+      head_.store(head, std::memory_order_release);
+      wake(consumer_parked_, not_empty_);
+    }
+  }
+
+  // no more pushes, a waiting reader gives up once the ring is empty
+  void close(){
+    closed_.store(true, std::memory_order_release);
+    wake(consumer_parked_, not_empty_);
+  }
+
+  // contiguous readable bytes, release them with consume()
+  size_t peek(const u8*& data){
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t avail = head_.load(std::memory_order_acquire) - tail;
+    data = &buf[tail & mask];
+    return std::min(avail, capacity - (tail & mask));
+  }
+
+  void consume(size_t n){
+    tail_.store(tail_.load(std::memory_order_relaxed) + n, std::memory_order_release);
+    wake(producer_parked_, not_full_);
+  }
+
+  // waits for bytes to read. false when the ring is closed and empty
+  bool waitReadable(){
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    auto readable = [&]{ return head_.load(std::memory_order_acquire) != tail; };
+    waitUntil(consumer_parked_, not_empty_, [&]{ return readable() || closed_.load(std::memory_order_acquire); });
+    return readable();
+  }
+
+private:
+  static constexpr int SPIN_LIMIT = 64;
+
+  template <typename Ready>
+  void waitUntil(std::atomic<bool>& parked, std::condition_variable& cv, Ready ready){
+    for (int spin = 0; spin < SPIN_LIMIT; ++spin){
+      if (ready()) return;
+      std::this_thread::yield();
+    }
+    std::unique_lock<std::mutex> guard(park_);
+    parked.store(true, std::memory_order_relaxed);
+    // pairs with the fence in wake(): either we see the other side's progress or it sees parked
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    cv.wait(guard, ready);
+    parked.store(false, std::memory_order_relaxed);
+  }
+
+  void wake(std::atomic<bool>& parked, std::condition_variable& cv){
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!parked.load(std::memory_order_relaxed)) return;
+    // taking the lock means the other side is either before its check or already waiting
+    { std::lock_guard<std::mutex> guard(park_); }
+    cv.notify_one();
+  }
+
+  u8* buf;
+  size_t capacity;
+  size_t mask;
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+  alignas(64) std::atomic<bool> producer_parked_{false};
+  std::atomic<bool> consumer_parked_{false};
+  std::atomic<bool> closed_{false};
+  std::mutex park_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+};
+
+class TraceWriter {
+public:
+  explicit TraceWriter(Arena& arena) : ring(arena.alloc<u8>(RING_SIZE), RING_SIZE) {}
+
+  bool open(const char* path, const int* regs, unsigned flags){
+    out = std::fopen(path, "wb");
+    if (!out) return false;
+
+    std::memcpy(pending, trace::MAGIC, sizeof(trace::MAGIC));
+    pending_len = sizeof(trace::MAGIC);
+    pending[pending_len++] = trace::VERSION;
+    pending[pending_len++] = REG_COUNT;
+    for (int i = 0; i < REG_COUNT; ++i){
+      pending_len += trace::putSigned(pending + pending_len, regs[i]);
+    }
+    pending_len += trace::putUnsigned(pending + pending_len, flags);
+
+    writer = std::thread(&TraceWriter::drain, this);
+    return true;
+  }
+
+  void step(u32 ip, const int* before, const int* after, unsigned flags_before, unsigned flags_after){
+    if (pending_len > sizeof(pending) - MAX_STEP) flush();
+
+    u8* p = pending + pending_len;
+    *p++ = trace::TRACE_STEP;
+    p += trace::putSigned(p, int32_t(ip - last_ip - 1));
+    last_ip = ip;
+
+    u32 mask = 0;
+    for (int i = 0; i < REG_COUNT; ++i){
+      if (before[i] != after[i]) mask |= 1 << i;
+    }
+    p += trace::putUnsigned(p, mask);
+    for (int i = 0; i < REG_COUNT; ++i){
+      if (mask & (1 << i)) p += trace::putSigned(p, after[i] - before[i]);
+    }
+    p += trace::putUnsigned(p, flags_before ^ flags_after);
+    pending_len = p - pending;
+  }
+
+  // memory records of a step go out before its TRACE_STEP record
+  void memoryWrite(u32 addr, const u8* data, u32 len){
+    if (pending_len > sizeof(pending) - 1 - 2 * trace::MAX_VARINT) flush();
+    u8* p = pending + pending_len;
+    *p++ = trace::TRACE_MEM;
+    p += trace::putUnsigned(p, addr);
+    p += trace::putUnsigned(p, len);
+    pending_len = p - pending;
+    if (len > sizeof(pending) - pending_len){
+      flush();
+      ring.push(data, len);
+    } else {
+      std::memcpy(pending + pending_len, data, len);
+      pending_len += len;
+    }
+  }
+
+  // false when any part of the trace could not be written
+  bool close(){
+    flush();
+    ring.close();
+    writer.join();
+    bool flushed = std::fflush(out) == 0;
+    bool closed = std::fclose(out) == 0;
+    return !write_failed && flushed && closed;
+  }
+
+private:
+  static constexpr size_t RING_SIZE = 1 << 20;
+  static constexpr size_t MAX_STEP = 1 + trace::MAX_VARINT * (REG_COUNT + 3);
+
+  void flush(){
+    ring.push(pending, pending_len);
+    pending_len = 0;
+  }
+
+  void drain(){
+    const u8* data;
+    while (true){
+      size_t n = ring.peek(data);
+      if (n){
+        // after a failed write the ring is still drained, so the simulator never blocks on it
+        if (!write_failed && std::fwrite(data, 1, n, out) != n) write_failed = true;
+        ring.consume(n);
+      } else if (!ring.waitReadable()){
+        break;
+      }
+    }
+  }
+
+  TraceRing ring;
+  std::FILE* out = nullptr;
+  std::thread writer;
+  bool write_failed = false;  // only touched by the writer thread until close() joins it
+  u8 pending[4096];
+  size_t pending_len = 0;
+  u32 last_ip = u32(-1);
+};
+
+template <typename Timing, typename Debug>
+void runTraced(const Program& program, Timing& timing, Debug& debug, TraceWriter& trace){
+  record_writes = true;
+  for (u32 ip = 0; ip < program.size; ++ip){
+    int before[REG_COUNT];
+    std::memcpy(before, registers, sizeof(registers));
+    unsigned flags_before = flag_registers.to_ulong();
+    mem_write_count = 0;
+    const Instruction& inst = debug.fetch(program.code[ip]);
+    timing.before(inst);
+    execute(inst);
+    timing.after(inst);
+    debug.after(inst);
+    for (int i = 0; i < mem_write_count; ++i){
+      trace.memoryWrite(mem_writes[i].addr, memory + mem_writes[i].addr, mem_writes[i].len);
+    }
+    trace.step(ip, before, registers, flags_before, flag_registers.to_ulong());
+  }
+  record_writes = false;
+}
+
+// decimal or 0x prefixed hex command line number
+bool parseArgNumber(std::string_view text, u32& value){
+  int base = 10;
+  if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X')){
+    text.remove_prefix(2);
+    base = 16;
+  }
+  auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value, base);
+  return ec == std::errc() && ptr == text.data() + text.size() && !text.empty();
+}
+
+// <address>[:<length>], a physical address range inside the 1MB
+bool parseWatch(std::string_view spec, u32& addr, u32& len){
+  size_t colon = spec.find(':');
+  len = 1;
+  if (!parseArgNumber(spec.substr(0, colon), addr)) return false;
+  if (colon != std::string_view::npos && !parseArgNumber(spec.substr(colon + 1), len)) return false;
+  return len > 0 && addr < MEMORY_SIZE && len <= MEMORY_SIZE - addr;
+}
+
+int main(int argc, char *argv[]){
+  const char* statesPath = nullptr;
+  const char* tracePath = nullptr;
+  const char* dumpPath = nullptr;
+  const char* timingName = nullptr;
+  std::vector<const char*> breakArgs;
+  std::vector<const char*> watchArgs;
+  bool measure = false;
+  int arg = 1;
+  for (; arg + 1 < argc; arg += 2){
+    if (std::strcmp(argv[arg], "--perf") == 0){
+      // the only option without a value
+      measure = true;
+      --arg;
+    } else if (std::strcmp(argv[arg], "--batch") == 0) statesPath = argv[arg + 1];
+    else if (std::strcmp(argv[arg], "--trace") == 0) tracePath = argv[arg + 1];
+    else if (std::strcmp(argv[arg], "--dump-memory") == 0) dumpPath = argv[arg + 1];
+    else if (std::strcmp(argv[arg], "--timing") == 0) timingName = argv[arg + 1];
+    else if (std::strcmp(argv[arg], "--break") == 0) breakArgs.push_back(argv[arg + 1]);
+    else if (std::strcmp(argv[arg], "--watch") == 0) watchArgs.push_back(argv[arg + 1]);
+    else break;
+  }
+  bool bad_timing = timingName && std::strcmp(timingName, "8086") != 0 && std::strcmp(timingName, "8088") != 0;
+  bool debugging = !breakArgs.empty() || !watchArgs.empty();
+  if (arg != argc - 1 || bad_timing || (statesPath && (tracePath || dumpPath || timingName || debugging || measure))){
+    std::cerr << "Usage: " << argv[0] << " [--batch <states_file> | [--trace <trace_file>] [--dump-memory <file>] [--timing 8086|8088]"
+              << " [--break <line>]... [--watch <address>[:<length>]]... [--perf]] <filename.asm>" << std::endl;
+    return 1;
+  }
+
+  // --perf counts the read, decode (parse), execute and write phases, the report goes to stderr
+  std::optional<PerfCounters> perf;
+  if (measure) perf.emplace();
+  auto begin = [&](const char* phase){ if (perf) perf->begin(phase); };
+  auto end = [&](uint64_t instructions){ if (perf) perf->end(instructions); };
+
+  begin("read");
+  const char* path = argv[arg];
+  MappedFile source;
+  if (!source.open(path)){
+    std::cerr << "Error opening file: " << path << std::endl;
+    return 1;
+  }
+  if (perf) source.prefault();
+  end(0);
+
+  Arena arena;
+  Program program;
+  begin("decode");
+  if (!parseProgram(source, arena, program)){
+    return 1;
+  }
+  end(program.size);
+
+  if (statesPath){
+    return runBatch(statesPath, program, arena);
+  }
+
+  std::optional<Debugger> debugger;
+  if (debugging) debugger.emplace();
+  for (const char* text : breakArgs){
+    u32 line;
+    if (!parseArgNumber(text, line)){
+      std::cerr << "Error: invalid breakpoint line: " << text << std::endl;
+      return 1;
+    }
+    if (!debugger->addBreakpoint(program, line)){
+      std::cerr << "Error: no instruction on line " << line << std::endl;
+      return 1;
+    }
+  }
+  for (const char* text : watchArgs){
+    u32 addr, len;
+    if (!parseWatch(text, addr, len)){
+      std::cerr << "Error: invalid watchpoint: " << text << std::endl;
+      return 1;
+    }
+    debugger->addWatchpoint(addr, len);
+  }
+
+  std::cout << "Values of registers before simulation: " << std::endl;
+
+  // print the register values before the start of simulation
+  printRegisters();
+
+  // simulate the each instruction
+  std::optional<TraceWriter> trace;
+  if (tracePath){
+    trace.emplace(arena);
+    if (!trace->open(tracePath, registers, flag_registers.to_ulong())){
+      std::cerr << "Error opening file: " << tracePath << std::endl;
+      return 1;
+    }
+  }
+  uint64_t cycles = 0;
+  begin("execute");
+  auto simulate = [&](auto& timing){
+    auto runWith = [&](auto& debug){
+      if (trace) runTraced(program, timing, debug, *trace);
+      else run(program, timing, debug);
+    };
+    if (debugger){
+      runWith(*debugger);
+    } else {
+      NoDebug debug;
+      runWith(debug);
+    }
+    if constexpr (std::decay_t<decltype(timing)>::enabled) cycles = timing.cycles;
+  };
+  if (!timingName){
+    NoTiming timing;
+    simulate(timing);
+  } else if (std::strcmp(timingName, "8086") == 0){
+    Timing8086 timing;
+    simulate(timing);
+  } else {
+    Timing8088 timing;
+    simulate(timing);
+  }
+  // the program has no jumps, every instruction runs once
+  end(program.size);
+  if (trace && !trace->close()){
+    std::cerr << "Error writing file: " << tracePath << std::endl;
+    return 1;
+  }
+
+  begin("write");
+  std::cout << "Values of registers after simulation: " << std::endl;
+  printRegisters();
+  if (timingName){
+    std::cout << "Estimated cycles (" << timingName << "): " << cycles << std::endl;
+  }
+  end(0);
+  if (perf) perf->report(stderr);
+
+  if (dumpPath){
+    std::FILE* dump = std::fopen(dumpPath, "wb");
+    if (!dump || std::fwrite(memory, 1, MEMORY_SIZE, dump) != MEMORY_SIZE){
+      std::cerr << "Error writing file: " << dumpPath << std::endl;
+      return 1;
+    }
+    std::fclose(dump);
+  }
+
+  return 0;
+}
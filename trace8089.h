@@ -0,0 +1,62 @@
+/* binary execution trace written by simulate8089 --trace and read back by replay8089
+
+layout (all multi-byte numbers are LEB128 varints, signed ones are zigzag encoded first):
+
+    header:  "T89" version(u8) reg_count(u8) initial registers(signed...) initial flags(unsigned)
+    records: kind(u8) followed by the payload of that kind
+
+    TRACE_STEP: ip delta(signed, relative to previous ip + 1) changed register mask(unsigned)
+                register deltas(signed, new - old, one per set bit in register file order)
+                flags xor(unsigned, 0 when no flag changed)
+    TRACE_MEM:  physical address(unsigned) length(unsigned) the bytes written; the memory records
+                of a step come before its TRACE_STEP record
+
+a straight-line step that touches one register and no flags is 5 bytes. memory starts zeroed.
+*/
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+namespace trace {
+
+static constexpr char MAGIC[3] = {'T', '8', '9'};
+static constexpr uint8_t VERSION = 2;
+
+enum Kind : uint8_t { TRACE_STEP = 0, TRACE_MEM = 1 };
+
+// longest encoding of a 32 bit value
+static constexpr size_t MAX_VARINT = 5;
+
+inline size_t putUnsigned(uint8_t* out, uint32_t v){
+  size_t n = 0;
+  while (v >= 0x80){
+    out[n++] = uint8_t(v | 0x80);
+    v >>= 7;
+  }
+  out[n++] = uint8_t(v);
+  return n;
+}
+
+inline size_t putSigned(uint8_t* out, int32_t v){
+  return putUnsigned(out, (uint32_t(v) << 1) ^ uint32_t(v >> 31));
+}
+
+/* returns the number of bytes consumed, 0 when the input ends inside the varint
+ */
+inline size_t getUnsigned(const uint8_t* in, size_t avail, uint32_t& v){
+  v = 0;
+  for (size_t n = 0; n < avail && n < MAX_VARINT; ++n){
+    v |= uint32_t(in[n] & 0x7F) << (7 * n);
+    if (!(in[n] & 0x80)) return n + 1;
+  }
+  return 0;
+}
+
+inline size_t getSigned(const uint8_t* in, size_t avail, int32_t& v){
+  uint32_t u;
+  size_t n = getUnsigned(in, avail, u);
+  v = int32_t(u >> 1) ^ -int32_t(u & 1);
+  return n;
+}
+
+} // namespace trace